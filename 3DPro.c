@@ -329,9 +329,10 @@ void FA_NAKED( init_hw ) ( void )
 
 //------------------------------------------------------------------------------
 
-// Read the stick and create a report
+// Read the stick and create a report. Returns 0 if no valid packet was
+// read, in which case sw_report keeps the previous data.
 
-void getdata ( void )
+uint8_t getdata ( void )
 	{
     uint8_t
 	pkt_size, i ;
@@ -359,9 +360,12 @@ void getdata ( void )
 				memcpy(sw_report, ffp_packet, 6);		// Copy data into report
 			else
 				CopyFFPData( ffp_packet ) ;		// Copy data into report
+			return 1;
 			}
 			
 		}
+
+	return 0;
 	}
 
 //------------------------------------------------------------------------------
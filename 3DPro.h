@@ -204,8 +204,10 @@ extern uint8_t
     sw_reportsz ;			// Size of report in bytes
 
 extern void
-    init_hw( void ),			// Initialize HW & wait for stick
-    getdata( void ) ;			// Read stick and set up sw_report
+    init_hw( void ) ;			// Initialize HW & wait for stick
+
+extern uint8_t
+    getdata( void ) ;			// Read stick and set up sw_report, 0 if no valid packet
 
 //-------------------------------------------------------------------------------
 // 3DProasm.S interface
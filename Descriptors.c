@@ -695,6 +695,54 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport[] =
 		0x66,0x00,0x00,	// UNIT (None)
 	0xC0,	// END COLLECTION ()
 	
+	0x06,0x00,0xFF,	// USAGE_PAGE (Vendor Defined Page 1)
+	0x09,0x01,	// USAGE (Direct Force Report)
+	0xA1,0x02,	// COLLECTION (Logical)
+		0x85,0x0F,	// REPORT_ID (0F)
+		0x09,0x02,	// USAGE (Force X)
+		0x09,0x03,	// USAGE (Force Y)
+		0x15,0x81,	// LOGICAL_MINIMUM (-127)
+		0x25,0x7F,	// LOGICAL_MAXIMUM (127)
+		0x35,0x81,	// PHYSICAL_MINIMUM (-127)
+		0x45,0x7F,	// PHYSICAL_MAXIMUM (127)
+		0x75,0x08,	// REPORT_SIZE (08)
+		0x95,0x02,	// REPORT_COUNT (02)
+		0x91,0x02,	// OUTPUT (Data,Var,Abs)
+	0xC0,	// END COLLECTION ()
+	0x09,0x04,	// USAGE (Batch Update Report)
+	0xA1,0x02,	// COLLECTION (Logical)
+		0x85,0x10,	// REPORT_ID (10)
+		0x09,0x05,	// USAGE (Parameter Reports)
+		0x15,0x00,	// LOGICAL_MINIMUM (00)
+		0x26,0xFF,0x00,	// LOGICAL_MAXIMUM (255)
+		0x35,0x00,	// PHYSICAL_MINIMUM (00)
+		0x46,0xFF,0x00,	// PHYSICAL_MAXIMUM (255)
+		0x75,0x08,	// REPORT_SIZE (08)
+		0x95,0x18,	// REPORT_COUNT (24)
+		0x91,0x02,	// OUTPUT (Data,Var,Abs)
+	0xC0,	// END COLLECTION ()
+	0x09,0x06,	// USAGE (Group Operation Report)
+	0xA1,0x02,	// COLLECTION (Logical)
+		0x85,0x11,	// REPORT_ID (11)
+		0x09,0x07,	// USAGE (Operation)
+		0x15,0x01,	// LOGICAL_MINIMUM (01)
+		0x25,0x03,	// LOGICAL_MAXIMUM (03)
+		0x35,0x01,	// PHYSICAL_MINIMUM (01)
+		0x45,0x03,	// PHYSICAL_MAXIMUM (03)
+		0x75,0x08,	// REPORT_SIZE (08)
+		0x95,0x01,	// REPORT_COUNT (01)
+		0x91,0x02,	// OUTPUT (Data,Var,Abs)
+		0x09,0x08,	// USAGE (Effect Set)
+		0x15,0x00,	// LOGICAL_MINIMUM (00)
+		0x25,0x01,	// LOGICAL_MAXIMUM (01)
+		0x35,0x00,	// PHYSICAL_MINIMUM (00)
+		0x45,0x01,	// PHYSICAL_MAXIMUM (01)
+		0x75,0x01,	// REPORT_SIZE (01)
+		0x95,0x28,	// REPORT_COUNT (40)
+		0x91,0x02,	// OUTPUT (Data,Var,Abs)
+	0xC0,	// END COLLECTION ()
+	0x05,0x0F,	// USAGE_PAGE (Physical Interface)
+	
 	0x09,0xAB,	// USAGE (Create New Effect Report)
 	0xA1,0x02,	// COLLECTION (Logical)
 		0x85,0x05,	// REPORT_ID (05)
@@ -1377,6 +1425,54 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM WheelReport[] =
 		0x66,0x00,0x00,	// UNIT (None)
 	0xC0,	// END COLLECTION ()
 	
+	0x06,0x00,0xFF,	// USAGE_PAGE (Vendor Defined Page 1)
+	0x09,0x01,	// USAGE (Direct Force Report)
+	0xA1,0x02,	// COLLECTION (Logical)
+		0x85,0x0F,	// REPORT_ID (0F)
+		0x09,0x02,	// USAGE (Force X)
+		0x09,0x03,	// USAGE (Force Y)
+		0x15,0x81,	// LOGICAL_MINIMUM (-127)
+		0x25,0x7F,	// LOGICAL_MAXIMUM (127)
+		0x35,0x81,	// PHYSICAL_MINIMUM (-127)
+		0x45,0x7F,	// PHYSICAL_MAXIMUM (127)
+		0x75,0x08,	// REPORT_SIZE (08)
+		0x95,0x02,	// REPORT_COUNT (02)
+		0x91,0x02,	// OUTPUT (Data,Var,Abs)
+	0xC0,	// END COLLECTION ()
+	0x09,0x04,	// USAGE (Batch Update Report)
+	0xA1,0x02,	// COLLECTION (Logical)
+		0x85,0x10,	// REPORT_ID (10)
+		0x09,0x05,	// USAGE (Parameter Reports)
+		0x15,0x00,	// LOGICAL_MINIMUM (00)
+		0x26,0xFF,0x00,	// LOGICAL_MAXIMUM (255)
+		0x35,0x00,	// PHYSICAL_MINIMUM (00)
+		0x46,0xFF,0x00,	// PHYSICAL_MAXIMUM (255)
+		0x75,0x08,	// REPORT_SIZE (08)
+		0x95,0x18,	// REPORT_COUNT (24)
+		0x91,0x02,	// OUTPUT (Data,Var,Abs)
+	0xC0,	// END COLLECTION ()
+	0x09,0x06,	// USAGE (Group Operation Report)
+	0xA1,0x02,	// COLLECTION (Logical)
+		0x85,0x11,	// REPORT_ID (11)
+		0x09,0x07,	// USAGE (Operation)
+		0x15,0x01,	// LOGICAL_MINIMUM (01)
+		0x25,0x03,	// LOGICAL_MAXIMUM (03)
+		0x35,0x01,	// PHYSICAL_MINIMUM (01)
+		0x45,0x03,	// PHYSICAL_MAXIMUM (03)
+		0x75,0x08,	// REPORT_SIZE (08)
+		0x95,0x01,	// REPORT_COUNT (01)
+		0x91,0x02,	// OUTPUT (Data,Var,Abs)
+		0x09,0x08,	// USAGE (Effect Set)
+		0x15,0x00,	// LOGICAL_MINIMUM (00)
+		0x25,0x01,	// LOGICAL_MAXIMUM (01)
+		0x35,0x00,	// PHYSICAL_MINIMUM (00)
+		0x45,0x01,	// PHYSICAL_MAXIMUM (01)
+		0x75,0x01,	// REPORT_SIZE (01)
+		0x95,0x28,	// REPORT_COUNT (40)
+		0x91,0x02,	// OUTPUT (Data,Var,Abs)
+	0xC0,	// END COLLECTION ()
+	0x05,0x0F,	// USAGE_PAGE (Physical Interface)
+	
 	0x09,0xAB,	// USAGE (Create New Effect Report)
 	0xA1,0x02,	// COLLECTION (Logical)
 		0x85,0x05,	// REPORT_ID (05)
@@ -1557,6 +1653,60 @@ const USB_Descriptor_Device_t PROGMEM DeviceDescriptorWheel =
 	.NumberOfConfigurations = FIXED_NUM_CONFIGURATIONS
 };
 
+#ifdef ENABLE_JOYSTICK_SERIAL
+/** Device descriptors used when the COM serial port is disabled. These have their own product IDs,
+ *  so that the host does not mix up the cached configurations of the two variants. The IDs of the
+ *  builds without ENABLE_JOYSTICK_SERIAL above are not used here, since this build presents the
+ *  serial wheel as 0x2056 and the serial joystick as 0x204E. The serial variants keep their IDs,
+ *  so existing installs (see the .inf files) still match them.
+ */
+const USB_Descriptor_Device_t PROGMEM DeviceDescriptorJoystickLean =
+{
+	.Header                 = {.Size = sizeof(USB_Descriptor_Device_t), .Type = DTYPE_Device},
+
+	.USBSpecification       = VERSION_BCD(01.10),
+
+	.Class                  = USB_CSCP_NoDeviceClass,
+	.SubClass               = USB_CSCP_NoDeviceSubclass,
+	.Protocol               = USB_CSCP_NoDeviceProtocol,
+
+	.Endpoint0Size          = FIXED_CONTROL_ENDPOINT_SIZE,
+
+	.VendorID               = 0x03EB,
+	.ProductID              = 0x2057,
+	.ReleaseNumber          = VERSION_BCD(00.01),
+
+	.ManufacturerStrIndex   = 0x01,
+	.ProductStrIndex        = 0x02,
+	.SerialNumStrIndex      = NO_DESCRIPTOR,
+
+	.NumberOfConfigurations = FIXED_NUM_CONFIGURATIONS
+};
+
+const USB_Descriptor_Device_t PROGMEM DeviceDescriptorWheelLean =
+{
+	.Header                 = {.Size = sizeof(USB_Descriptor_Device_t), .Type = DTYPE_Device},
+
+	.USBSpecification       = VERSION_BCD(01.10),
+
+	.Class                  = USB_CSCP_NoDeviceClass,
+	.SubClass               = USB_CSCP_NoDeviceSubclass,
+	.Protocol               = USB_CSCP_NoDeviceProtocol,
+
+	.Endpoint0Size          = FIXED_CONTROL_ENDPOINT_SIZE,
+
+	.VendorID               = 0x03EB,
+	.ProductID              = 0x2058,
+	.ReleaseNumber          = VERSION_BCD(00.01),
+
+	.ManufacturerStrIndex   = 0x01,
+	.ProductStrIndex        = 0x02,
+	.SerialNumStrIndex      = NO_DESCRIPTOR,
+
+	.NumberOfConfigurations = FIXED_NUM_CONFIGURATIONS
+};
+#endif // ENABLE_JOYSTICK_SERIAL
+
 /** Configuration descriptor structure. This descriptor, located in FLASH memory, describes the usage
  *  of the device in one of its supported configurations, including information about any device interfaces
  *  and endpoints. The descriptor is read out by the USB host during the enumeration process when selecting
@@ -1740,6 +1890,74 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 #endif // ENABLE_JOYSTICK_SERIAL
 };
 
+#ifdef ENABLE_JOYSTICK_SERIAL
+/** Configuration descriptor used when the COM serial port is disabled: the joystick only. */
+const USB_Descriptor_ConfigurationLean_t PROGMEM ConfigurationDescriptorLean =
+{
+	.Config =
+		{
+			.Header                 = {.Size = sizeof(USB_Descriptor_Configuration_Header_t), .Type = DTYPE_Configuration},
+
+			.TotalConfigurationSize = sizeof(USB_Descriptor_ConfigurationLean_t),
+			.TotalInterfaces        = 1,
+
+			.ConfigurationNumber    = 1,
+			.ConfigurationStrIndex  = NO_DESCRIPTOR,
+
+			.ConfigAttributes       = (USB_CONFIG_ATTR_RESERVED | USB_CONFIG_ATTR_SELFPOWERED),
+
+			.MaxPowerConsumption    = USB_CONFIG_POWER_MA(100)
+		},
+
+	.HID_Interface =
+		{
+			.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
+
+			.InterfaceNumber        = 0x00,
+			.AlternateSetting       = 0x00,
+
+			.TotalEndpoints         = 2,
+
+			.Class                  = HID_CSCP_HIDClass,
+			.SubClass               = HID_CSCP_NonBootSubclass,
+			.Protocol               = HID_CSCP_NonBootProtocol,
+
+			.InterfaceStrIndex      = NO_DESCRIPTOR
+		},
+
+	.HID_JoystickHID =
+		{
+			.Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID},
+
+			.HIDSpec                = VERSION_BCD(01.11),
+			.CountryCode            = 0x00,
+			.TotalReportDescriptors = 1,
+			.HIDReportType          = HID_DTYPE_Report,
+			.HIDReportLength        = sizeof(JoystickReport)
+		},
+
+	.HID_ReportINEndpoint =
+		{
+			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+			.EndpointAddress        = (ENDPOINT_DIR_IN | JOYSTICK_EPNUM),
+			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+			.EndpointSize           = JOYSTICK_EPSIZE,
+			.PollingIntervalMS      = 0x01
+		},
+
+	.HID_ReportOUTEndpoint =
+		{
+			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+			.EndpointAddress        = (ENDPOINT_DIR_OUT | FFB_EPNUM),
+			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+			.EndpointSize           = FFB_EPSIZE,
+			.PollingIntervalMS      = 0x01
+		},
+};
+#endif // ENABLE_JOYSTICK_SERIAL
+
 /** Language descriptor structure. This descriptor, located in FLASH memory, is returned when the host requests
  *  the string descriptor with index 0 (the first index). It is actually an array of 16-bit integers, which indicate
  *  via the language ID table available at USB.org what languages the device supports for its string descriptors.
@@ -1800,6 +2018,17 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 	{
 		case DTYPE_Device:
 			//LogTextP(PSTR("GetDesc/Device:"));
+#ifdef ENABLE_JOYSTICK_SERIAL
+			if (!gSerialEnabled)
+				{
+				if (sw_id == SW_ID_FFPW)
+					Address = &DeviceDescriptorWheelLean;
+				else
+					Address = &DeviceDescriptorJoystickLean;
+				Size    = sizeof(USB_Descriptor_Device_t);
+				break;
+				}
+#endif // ENABLE_JOYSTICK_SERIAL
 			if (sw_id == SW_ID_FFPW)
 			Address = &DeviceDescriptorWheel;
 			else
@@ -1808,6 +2037,14 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 			break;
 		case DTYPE_Configuration:
 			//LogTextP(PSTR("GetDesc/Conf:"));
+#ifdef ENABLE_JOYSTICK_SERIAL
+			if (!gSerialEnabled)
+				{
+				Address = &ConfigurationDescriptorLean;
+				Size    = sizeof(USB_Descriptor_ConfigurationLean_t);
+				break;
+				}
+#endif // ENABLE_JOYSTICK_SERIAL
 			Address = &ConfigurationDescriptor;
 			Size    = sizeof(USB_Descriptor_Configuration_t);
 			break;
@@ -1856,7 +2093,9 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 		case DTYPE_Interface:
 			//LogTextP(PSTR("GetDesc/Interface:"));
 			Size    = sizeof(USB_Descriptor_Interface_t);
-			if (wIndex == 0)
+			if (!gSerialEnabled && wIndex != 0)
+				Size = NO_DESCRIPTOR;
+			else if (wIndex == 0)
 				Address = &ConfigurationDescriptor.HID_Interface;
 			else if (wIndex == 1)
 				Address = &ConfigurationDescriptor.CDC1_CCI_Interface;
@@ -37,7 +37,8 @@
 
 // Define: ENABLE_JOYSTICK_SERIAL
 //	When defined, includes USB COM serial port to the device
-//	in addition to joystick.
+//	in addition to joystick. Whether the port is actually used
+//	is chosen at startup, see gSerialEnabled.
 #define ENABLE_JOYSTICK_SERIAL
 
 	/* Includes: */
@@ -83,6 +84,20 @@
 
 		} USB_Descriptor_Configuration_t;
 
+#ifdef ENABLE_JOYSTICK_SERIAL
+		/** Configuration without the COM serial port, used when the port is disabled at startup. */
+		typedef struct
+		{
+			USB_Descriptor_Configuration_Header_t Config;
+
+			// Joystick HID Interface
+			USB_Descriptor_Interface_t            HID_Interface;
+			USB_HID_Descriptor_HID_t              HID_JoystickHID;
+			USB_Descriptor_Endpoint_t             HID_ReportOUTEndpoint;
+			USB_Descriptor_Endpoint_t             HID_ReportINEndpoint;
+		} USB_Descriptor_ConfigurationLean_t;
+#endif // ENABLE_JOYSTICK_SERIAL
+
 		// Joystick stuff
 
 		/** Endpoint number of the Joystick HID reporting IN endpoint. */
@@ -115,6 +130,13 @@
 		/** Size in bytes of the CDC data IN and OUT endpoints. */
 		#define CDC_TXRX_EPSIZE                16
 
+	/* External Variables: */
+		/** True if the device presents the COM serial port in addition to the joystick. Set before
+		 *  USB_Init() and never changed afterwards, since the host reads the descriptors only once.
+		 *  Always false when ENABLE_JOYSTICK_SERIAL is not defined.
+		 */
+		extern bool gSerialEnabled;
+
 	/* Function Prototypes: */
 		uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 		                                    const uint8_t wIndex,
@@ -161,7 +161,7 @@ int Joystick_CreateInputReport(uint8_t inReportId, USB_JoystickReport_Data_t* co
 #ifndef USE_FAKE_JOYSTICK
 	// Code from 3DPVert begins-->
 	SetTMPS( 0, 64 ) ;		// Set T0 prescaler to / 64 for query
-	getdata();
+	InputChanged = getdata();	// nothing new if the stick did not answer
 
 	// -------------------------------------------------------------------------------
 	// *******************************************************************************
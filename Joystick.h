@@ -67,7 +67,8 @@ int Joystick_Connect(void);
 
 // Gets called when input report of joysticks position, buttons etc. are
 // requested. Data written to <outReportData> is sent to host if the function
-// returns true. If false is returned, nothing is sent.
+// returns true. If false is returned, nothing is sent; the joystick could not
+// be read and <outReportData> holds the previous data.
 // If <inReportId> has value INPUT_REPORTID_ALL, all input report IDs should
 // generated.
 int Joystick_CreateInputReport(uint8_t inReportId, USB_JoystickReport_Data_t* const outReportData);
@@ -44,6 +44,7 @@ volatile uint8_t gDebugMode = 2; // set this higher if debugging e.g. at startup
 // Internal buffer for sending debug data to USB COM-port
 volatile char debug_buffer[DEBUG_BUFFER_SIZE];
 volatile uint16_t debug_buffer_used = 0;
+volatile bool debug_buffer_lost = false;	// data was discarded since the last flush
 #endif
 
 void LogSendData(uint8_t *data, uint16_t len)
@@ -204,7 +205,10 @@ void LogSendByte(uint8_t data)
 	if (gDebugMode & DEBUG_TO_USB)
 		{
 		if (debug_buffer_used >= DEBUG_BUFFER_SIZE)
-			return;	// overflow - discard
+			{
+			debug_buffer_lost = true;	// overflow - discard, marked in the output
+			return;
+			}
 
 		debug_buffer[debug_buffer_used++] = data;
 		}
@@ -227,7 +231,7 @@ void FlushDebugBuffer(void)
 #ifdef DEBUG_ENABLE_USB
 	uint16_t len = debug_buffer_used;	// use this to lessen chance of value changing in the middle of sending it - e.g. in interrupt
 
-	if (len == 0)
+	if (len == 0 || !gSerialEnabled)
 		return;
 
 	debug_buffer_used = 0;
@@ -238,6 +242,13 @@ void FlushDebugBuffer(void)
 	// Write the String to the Endpoint
 	Endpoint_Write_Stream_LE(&debug_buffer, len, NULL);
 
+	// Show where data was lost
+	if (debug_buffer_lost)
+		{
+		debug_buffer_lost = false;
+		Endpoint_Write_PStream_LE(PSTR(" ...\r\n"), 6, NULL);
+		}
+
 	// Finalize the stream transfer to send the last packet
 	Endpoint_ClearIN();
 
@@ -29,6 +29,7 @@
 #include "ffb-pro.h"
 #include "ffb.h"
 
+#include <stddef.h>
 #include <util/delay.h>
 #include "debug.h"
 
@@ -55,6 +56,20 @@ uint8_t FfbproUsbToMidiEffectType(uint8_t usb_effect_type)
 	return usbToMidiEffectType[usb_effect_type];
 }
 
+uint8_t FfbproEffectDataLength(uint8_t usb_effect_type)
+{
+	switch (usb_effect_type) {
+		case USB_EFFECT_SPRING:
+		case USB_EFFECT_DAMPER:
+		case USB_EFFECT_INERTIA:
+			return sizeof(FFP_MIDI_Effect_Spring_Inertia_Damper);
+		case USB_EFFECT_FRICTION:
+			return sizeof(FFP_MIDI_Effect_Friction);
+		default:
+			return sizeof(FFP_MIDI_Effect_Basic);
+	}
+}
+
 static void FfbproInitPulses(uint8_t count)
 {
 	while (count--) {
@@ -157,10 +172,10 @@ void FfbproSetAutoCenter(uint8_t enable)
 		0xc5, 0x06,
 	};
 
-	FfbSendData(ac_enable, sizeof(ac_enable));
+	FfbSendOperation(0, ac_enable, sizeof(ac_enable));
 	if (!enable) {
 		WaitMs(70);
-		FfbSendData(ac_disable, sizeof(ac_disable));
+		FfbSendOperation(0, ac_disable, sizeof(ac_disable));
 	}
 }
 
@@ -179,7 +194,7 @@ static void FfbproSendEffectOper(uint8_t effectId, uint8_t operation)
 	midi_cmd[0] = 0xB5;
 	midi_cmd[1] = operation;
 	midi_cmd[2] = effectId;
-	FfbSendData(midi_cmd, 3);
+	FfbSendOperation(effectId, midi_cmd, 3);
 }
 
 void FfbproStartEffect(uint8_t effectId)
@@ -192,38 +207,160 @@ void FfbproStopEffect(uint8_t effectId)
 	FfbproSendEffectOper(effectId, 0x30);
 }
 
+void FfbproStopAllEffects(void)
+{
+	FfbproSendEffectOper(0x7F, 0x30);
+}
+
 void FfbproFreeEffect(uint8_t effectId)
 {
 	FfbproSendEffectOper(effectId, 0x10);
 }
 
+void FfbproSetDownloadIndex(TEffectState* effect, uint8_t index)
+{
+	// unknown1 = effect index overwrites that effect instead of allocating a new one
+	FfbSetEffectByte(effect, offsetof(FFP_MIDI_Effect_Basic, unknown1), index);
+}
+
 // modify operations ---------------------------------------------------------
 
 // Send to MIDI effect data modification to the given address of the given effect
 void FfbproSendModify(uint8_t effectId, uint8_t address, uint16_t value)
 {
+	uint8_t midi_cmd[6];
+
 	// Modify + Address
-	uint8_t midi_cmd[3];
 	midi_cmd[0] = 0xB5;
 	midi_cmd[1] = address;
 	midi_cmd[2] = effectId;
-	FfbSendData(midi_cmd, 3);
 
 	// New value
-	midi_cmd[0] = 0xA5;
-	midi_cmd[1] = value & 0x7F;
-	midi_cmd[2] = (value & 0x7F00) >> 8;
-	FfbSendData(midi_cmd, 3);
+	midi_cmd[3] = 0xA5;
+	midi_cmd[4] = value & 0x7F;
+	midi_cmd[5] = (value & 0x7F00) >> 8;
+
+	// Both in one go so that nothing gets in between
+	FfbSendEffectData(effectId, midi_cmd, 6);
+}
+
+// Modify addresses are 0x40, 0x44, ..., 0x7C i.e. one bit each in effect's <dirty>
+#define FFP_MODIFY_BIT(address)	(1 << (((address) - 0x40) >> 2))
+
+// Returns the location of the value at the given modify address in the effect data.
+// <is_byte> tells if it is an 8-bit value instead of a 16-bit one.
+static void* FfbproModifyFieldOf(TEffectState* effect, uint8_t address, bool* is_byte)
+{
+	FFP_MIDI_Effect_Basic *midi_data = (FFP_MIDI_Effect_Basic *)effect->data;
+	FFP_MIDI_Effect_Spring_Inertia_Damper *condition_data =
+		(FFP_MIDI_Effect_Spring_Inertia_Damper *)effect->data;	// friction shares the coefficients
+
+	uint8_t waveForm = midi_data->waveForm;
+	bool is_condition = (waveForm >= 0x0d && waveForm <= 0x10);
+	bool is_ramp = (waveForm == 0x06 || waveForm == 0x07);
+
+	*is_byte = false;
+
+	switch (address) {
+		case 0x40: return &midi_data->duration;
+		case 0x48: return is_condition ? &condition_data->coeffAxis0 : &midi_data->direction;
+		case 0x4C: return &condition_data->coeffAxis1;
+		case 0x50: return &condition_data->offsetAxis0;
+		case 0x54: return &condition_data->offsetAxis1;
+		case 0x5C: return &midi_data->attackTime;
+		case 0x60: return &midi_data->fadeTime;
+		case 0x64: *is_byte = true; return &midi_data->attackLevel;
+		case 0x6C: *is_byte = true; return &midi_data->fadeLevel;
+		case 0x70: return &midi_data->frequency;
+		case 0x74:
+			if (waveForm == 0x12) {
+				*is_byte = true;	// constant
+				return &midi_data->magnitude;
+			}
+			return is_ramp ? &midi_data->param2 : &midi_data->param1;
+		case 0x78: return is_ramp ? &midi_data->param1 : &midi_data->param2;
+		case 0x7C: return &midi_data->param1;
+		default: return 0;
+	}
 }
 
-void FfbproModifyDuration(uint8_t effectId, uint16_t duration)
+// As FfbproModifyFieldOf() but 0 also for a value that is not in the data
+// of this type of effect, e.g. the envelope of a condition.
+static void* FfbproModifyField(TEffectState* effect, uint8_t address, bool* is_byte)
 {
-	FfbproSendModify(effectId, 0x40, duration);
+	uint8_t* field = FfbproModifyFieldOf(effect, address, is_byte);
+	if (field && field - effect->data + (*is_byte ? 1 : 2) > FfbEffectDataSize(effect))
+		return 0;
+	return field;
+}
+
+// Returns the current value in the effect data for the given modify address
+static uint16_t FfbproGetModifyValue(TEffectState* effect, uint8_t address)
+{
+	bool is_byte;
+	void* field = FfbproModifyField(effect, address, &is_byte);
+	if (!field)
+		return 0;
+	return is_byte ? *(uint8_t*)field : *(uint16_t*)field;
+}
+
+// Mark the value at the given modify address of the effect to be sent to the joystick.
+// The values are read from the effect data only when they are flushed, so that
+// repeated changes to a value before that go out as a single modification.
+static void FfbproQueueModify(TEffectState* effect, uint8_t address)
+{
+	uint16_t bit = FFP_MODIFY_BIT(address);
+	if (effect->dirty & bit)
+		gMidiStats.modifiesCoalesced++;
+	effect->dirty |= bit;
+}
+
+// Set the value at the given modify address of the effect.
+// The effect data of an effect in the joystick mirrors what the joystick has, except
+// for values marked dirty which are still to be sent. So a modification is needed
+// only when the new (already MIDI-scaled) value differs from the effect data.
+static void FfbproUpdate(TEffectState* effect, uint8_t address, uint16_t value)
+{
+	bool is_byte;
+	void* field = FfbproModifyField(effect, address, &is_byte);
+	if (!field)
+		return;
+
+	uint16_t old_value = is_byte ? *(uint8_t*)field : *(uint16_t*)field;
+	if (value == old_value && (effect->state & MEffectState_SentToJoystick)) {
+		gMidiStats.modifiesSuppressed++;
+		return;
+	}
+
+	uint8_t offset = (uint8_t*)field - effect->data;
+	if (is_byte)
+		FfbSetEffectByte(effect, offset, value);
+	else
+		FfbSetEffectWord(effect, offset, value);
+
+	if (effect->state & MEffectState_SentToJoystick)
+		FfbproQueueModify(effect, address);
+}
+
+void FfbproFlushModify(uint8_t effectId, TEffectState* effect)
+{
+	uint16_t dirty = effect->dirty;
+	effect->dirty = 0;
+
+	for (uint8_t address = 0x40; dirty; address += 4, dirty >>= 1) {
+		if (dirty & 1)
+			FfbproSendModify(effectId, address, FfbproGetModifyValue(effect, address));
+	}
+}
+
+void FfbproModifyDuration(uint8_t effectId, TEffectState* effect, uint16_t duration)
+{
+	FfbproUpdate(effect, 0x40, duration);
 }
 
 void FfbproSetEnvelope(
 	USB_FFBReport_SetEnvelope_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 	uint8_t eid = data->effectBlockIndex;
 	
@@ -268,36 +405,27 @@ void FfbproSetEnvelope(
 		FlushDebugBuffer();
 		}
 		
-	volatile FFP_MIDI_Effect_Basic *midi_data = (volatile FFP_MIDI_Effect_Basic *)&effect->data;
-
 	effect->usb_attackLevel = data->attackLevel;
 	effect->usb_fadeLevel = data->fadeLevel;
 	effect->usb_fadeTime = data->fadeTime;
 
-	midi_data->attackLevel = CalcGain(data->attackLevel, effect->usb_gain);
-	midi_data->fadeLevel = CalcGain(data->fadeLevel, effect->usb_gain);
+	FfbproUpdate(effect, 0x64, CalcGain(data->attackLevel, effect->usb_gain));
+	FfbproUpdate(effect, 0x6C, CalcGain(data->fadeLevel, effect->usb_gain));
 
-	midi_data->attackTime = UsbUint16ToMidiUint14_Time(data->attackTime);
+	FfbproUpdate(effect, 0x5C, UsbUint16ToMidiUint14_Time(data->attackTime));
 
 	if (data->fadeTime == USB_DURATION_INFINITE)
-		midi_data->fadeTime = MIDI_DURATION_INFINITE;
+		FfbproUpdate(effect, 0x60, MIDI_DURATION_INFINITE);
 	else
-		midi_data->fadeTime = UsbUint16ToMidiUint14_Time(effect->usb_duration - effect->usb_fadeTime);
-
-	if (effect->state & MEffectState_SentToJoystick) {
-		FfbproSendModify(eid, 0x60, midi_data->fadeTime);
-		FfbproSendModify(eid, 0x5C, midi_data->attackTime);
-		FfbproSendModify(eid, 0x6C, midi_data->fadeLevel);
-		FfbproSendModify(eid, 0x64, midi_data->attackLevel);
-	}
+		FfbproUpdate(effect, 0x60, UsbUint16ToMidiUint14_Time(effect->usb_duration - effect->usb_fadeTime));
 }
 
 void FfbproSetCondition(
 	USB_FFBReport_SetCondition_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 	uint8_t eid = data->effectBlockIndex;
-	volatile FFP_MIDI_Effect_Basic *common_midi_data = (volatile FFP_MIDI_Effect_Basic *)&effect->data;
+	FFP_MIDI_Effect_Basic *common_midi_data = (FFP_MIDI_Effect_Basic *)effect->data;
 
 	/*
 	USB effect data:
@@ -329,50 +457,25 @@ void FfbproSetCondition(
 		case 0x0e:	// damper (midi: 0x0e)
 		case 0x0f:	// inertia (midi: 0x0f)
 		{
-			volatile FFP_MIDI_Effect_Spring_Inertia_Damper *midi_data =
-				(FFP_MIDI_Effect_Spring_Inertia_Damper *)&effect->data;
-
 			if (data->parameterBlockOffset == 0) {
-				midi_data->coeffAxis0 = UsbInt8ToMidiInt14(data->positiveCoefficient);
-				midi_data->offsetAxis0 = UsbInt8ToMidiInt14(data->cpOffset);
+				FfbproUpdate(effect, 0x48, UsbInt8ToMidiInt14(data->positiveCoefficient));	// coeffAxis0
+				FfbproUpdate(effect, 0x50, UsbInt8ToMidiInt14(data->cpOffset));	// offsetAxis0
 			} else {
-				midi_data->coeffAxis1 = UsbInt8ToMidiInt14(data->positiveCoefficient);
+				FfbproUpdate(effect, 0x4C, UsbInt8ToMidiInt14(data->positiveCoefficient));	// coeffAxis1
 				if (data->cpOffset == 0x80)
-					midi_data->offsetAxis1 = 0x007f;
+					FfbproUpdate(effect, 0x54, 0x007f);	// offsetAxis1
 				else
-					midi_data->offsetAxis1 = UsbInt8ToMidiInt14(-data->cpOffset);
-			}
-
-			// Send data to MIDI
-			if (effect->state & MEffectState_SentToJoystick) {
-				if (data->parameterBlockOffset == 0) {
-					FfbproSendModify(eid, 0x48, midi_data->coeffAxis0);
-					FfbproSendModify(eid, 0x50, midi_data->offsetAxis0);
-				} else {
-					FfbproSendModify(eid, 0x4C, midi_data->coeffAxis1);
-					FfbproSendModify(eid, 0x54, midi_data->offsetAxis1);
-				}
+					FfbproUpdate(effect, 0x54, UsbInt8ToMidiInt14(-data->cpOffset));
 			}
 		}
 		break;
 		
 		case 0x10:	// friction (midi: 0x10)
 		{
-			volatile FFP_MIDI_Effect_Friction *midi_data =
-					(FFP_MIDI_Effect_Friction *)&effect->data;
-
 			if (data->parameterBlockOffset == 0)
-				midi_data->coeffAxis0 = UsbInt8ToMidiInt14(data->positiveCoefficient);
+				FfbproUpdate(effect, 0x48, UsbInt8ToMidiInt14(data->positiveCoefficient));	// coeffAxis0
 			else
-				midi_data->coeffAxis1 = UsbInt8ToMidiInt14(data->positiveCoefficient);
-
-			// Send data to MIDI
-			if (effect->state & MEffectState_SentToJoystick) {	// Send update
-				if (data->parameterBlockOffset == 0)
-					FfbproSendModify(eid, 0x48, midi_data->coeffAxis0);
-				else
-					FfbproSendModify(eid, 0x4C, midi_data->coeffAxis1);
-			}
+				FfbproUpdate(effect, 0x4C, UsbInt8ToMidiInt14(data->positiveCoefficient));	// coeffAxis1
 		}
 		break;
 		
@@ -383,7 +486,7 @@ void FfbproSetCondition(
 
 void FfbproSetPeriodic(
 	USB_FFBReport_SetPeriodic_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 	uint8_t eid = data->effectBlockIndex;
 
@@ -413,49 +516,50 @@ void FfbproSetPeriodic(
 		FlushDebugBuffer();
 		}
 	
-	volatile FFP_MIDI_Effect_Basic *midi_data = (volatile FFP_MIDI_Effect_Basic *)&effect->data;
+	FFP_MIDI_Effect_Basic *midi_data = (FFP_MIDI_Effect_Basic *)effect->data;
 
 	effect->usb_magnitude = data->magnitude;
 
-	midi_data->param1 = 0x007f;
-	midi_data->param2 = 0x0101;
-
 	// Calculate frequency (in MIDI it is in units of Hz and can have value from 1 to 169Hz)
 	if (data->period >= 1000)
-		midi_data->frequency = 0x0001; //1Hz
+		FfbproUpdate(effect, 0x70, 0x0001); //1Hz
 	else if (data->period <= 5)
-		midi_data->frequency = 0x0129; //169Hz
+		FfbproUpdate(effect, 0x70, 0x0129); //169Hz
 	else
-		midi_data->frequency = UsbUint16ToMidiUint14(1000 / data->period);
+		FfbproUpdate(effect, 0x70, UsbUint16ToMidiUint14(1000 / data->period));
 
 	// Check phase if relevant (+90 phase for sine makes it a cosine)
 	if (midi_data->waveForm == 2 || midi_data->waveForm == 3) // sine
 	{
 		if (data->phase >= 32 && data->phase <= 224) {
-			midi_data->waveForm = 3;	// cosine
+			FfbSetEffectByte(effect, offsetof(FFP_MIDI_Effect_Basic, waveForm), 3);	// cosine
 		} else {
-			midi_data->waveForm = 2;	// sine
+			FfbSetEffectByte(effect, offsetof(FFP_MIDI_Effect_Basic, waveForm), 2);	// sine
 		}
 
 		// Calculate min-max from magnitude and offset
 		uint8_t magnitude = CalcGain(data->magnitude, effect->usb_gain);	// already at MIDI-level i.e. 1/2 of USB level!
-		midi_data->param1 = UsbInt8ToMidiInt14(data->offset / 2 + magnitude); // max
-		midi_data->param2 = UsbInt8ToMidiInt14(data->offset / 2 - magnitude); // min
-		if (effect->state & MEffectState_SentToJoystick) {
-			FfbproSendModify(eid, 0x74, midi_data->param1);
-			FfbproSendModify(eid, 0x78, midi_data->param2);
-		}
+		FfbproUpdate(effect, 0x74, UsbInt8ToMidiInt14(data->offset / 2 + magnitude)); // param1 = max
+		FfbproUpdate(effect, 0x78, UsbInt8ToMidiInt14(data->offset / 2 - magnitude)); // param2 = min
 	}
-
-	if (effect->state & MEffectState_SentToJoystick) {
-		// FfbProSendModify(eid, 0x74, midi_data->magnitude); // FFP does not actually support changing magnitude on-fly here
-		FfbproSendModify(eid, 0x70, midi_data->frequency);
+	else
+	{
+		FfbSetEffectWord(effect, offsetof(FFP_MIDI_Effect_Basic, param1), 0x007f);
+		FfbSetEffectWord(effect, offsetof(FFP_MIDI_Effect_Basic, param2), 0x0101);
+
+		// FFP does not actually support changing magnitude on-fly here,
+		// so an effect already in the joystick must be sent again
+		uint8_t magnitude = CalcGain(data->magnitude, effect->usb_gain);
+		if (midi_data->magnitude != magnitude) {
+			FfbSetEffectByte(effect, offsetof(FFP_MIDI_Effect_Basic, magnitude), magnitude);
+			FfbRequestRedownload(effect);
+		}
 	}
 }
 
 void FfbproSetConstantForce(
 	USB_FFBReport_SetConstantForce_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 	uint8_t eid = data->effectBlockIndex;
 	/*
@@ -494,29 +598,22 @@ void FfbproSetConstantForce(
 		FlushDebugBuffer();
 		}
 	
-	volatile FFP_MIDI_Effect_Basic *midi_data = (volatile FFP_MIDI_Effect_Basic *)&effect->data;
-
 	effect->usb_magnitude = data->magnitude;
 
 	if (data->magnitude >= 0) {
-		midi_data->magnitude = CalcGain(data->magnitude, effect->usb_gain);
-		midi_data->param1 = 0x007f;
+		FfbproUpdate(effect, 0x74, CalcGain(data->magnitude, effect->usb_gain));	// magnitude
+		FfbproUpdate(effect, 0x7C, 0x007f);	// param1
 	} else {
-		midi_data->magnitude = CalcGain(-(data->magnitude+1), effect->usb_gain);
-		midi_data->param1 = 0x0101;
+		FfbproUpdate(effect, 0x74, CalcGain(-(data->magnitude+1), effect->usb_gain));
+		FfbproUpdate(effect, 0x7C, 0x0101);
 	}
 
-	midi_data->param2 = 0x0000;
-
-	if (effect->state & MEffectState_SentToJoystick) {
-		FfbproSendModify(eid, 0x74, midi_data->magnitude);
-		FfbproSendModify(eid, 0x7C, midi_data->param1);
-	}
+	FfbSetEffectWord(effect, offsetof(FFP_MIDI_Effect_Basic, param2), 0x0000);
 }
 
 void FfbproSetRampForce(
 	USB_FFBReport_SetRampForce_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 	if (DoDebug(DEBUG_DETAIL))
 		{
@@ -538,28 +635,19 @@ void FfbproSetRampForce(
 		int8_t	end;
 	*/
 	
-	volatile FFP_MIDI_Effect_Basic *midi_data = (volatile FFP_MIDI_Effect_Basic *)&effect->data;
-
 	if (data->start < 0)
-		midi_data->param1 = 0x0100 | (-(data->start+1));
+		FfbproUpdate(effect, 0x78, 0x0100 | (-(data->start+1)));	// param1
 	else
-		midi_data->param1 = data->start;
+		FfbproUpdate(effect, 0x78, data->start);
 
-	midi_data->param2 = UsbInt8ToMidiInt14(data->end);
-
-	if (effect->state & MEffectState_SentToJoystick) {
-		FfbproSendModify(data->reportId, 0x78, midi_data->param1);
-		FfbproSendModify(data->reportId, 0x74, midi_data->param2);
-	}
+	FfbproUpdate(effect, 0x74, UsbInt8ToMidiInt14(data->end));	// param2
 }
 
 int FfbproSetEffect(
 	USB_FFBReport_SetEffect_Output_Data_t *data,
-	volatile TEffectState* effect
+	TEffectState* effect
 )
 {
-	uint8_t eid = data->effectBlockIndex;
-
 	/*
 	USB effect data:
 		uint8_t	reportId;	// =1
@@ -575,8 +663,8 @@ int FfbproSetEffect(
 		uint8_t	directionY;	// angle (0=0 .. 180=0..360deg)
 	*/
 
-	volatile FFP_MIDI_Effect_Basic *midi_data = (volatile FFP_MIDI_Effect_Basic *)&effect->data;
-	uint8_t midi_data_len = sizeof(FFP_MIDI_Effect_Basic); 	// default MIDI data size
+	FFP_MIDI_Effect_Basic *midi_data = (FFP_MIDI_Effect_Basic *)effect->data;
+	uint8_t midi_data_len = FfbproEffectDataLength(data->effectType);
 	bool is_periodic = false;
 
 	// Fill in the effect type specific data
@@ -617,23 +705,25 @@ int FfbproSetEffect(
 			uint16_t usbdir = data->directionX;
 			usbdir = usbdir * 2;
 			uint16_t dir = (usbdir & 0x7F) + ( (usbdir & 0x0180) << 1 );
-			midi_data->direction = dir;
+			FfbproUpdate(effect, 0x48, dir);	// direction
 
 			// Recalculate fadeTime for MIDI since change to duration changes the fadeTime too
+			uint16_t fadeTime;
 			if (data->duration == USB_DURATION_INFINITE) {
-				midi_data->fadeTime = MIDI_DURATION_INFINITE;
+				fadeTime = MIDI_DURATION_INFINITE;
 			} else {
 				if (effect->usb_fadeTime == USB_DURATION_INFINITE) {
-					midi_data->fadeTime = MIDI_DURATION_INFINITE;
+					fadeTime = MIDI_DURATION_INFINITE;
 				} else {
 					if (effect->usb_duration > effect->usb_fadeTime) {
 						// add some safety and special case handling
-						midi_data->fadeTime = UsbUint16ToMidiUint14_Time(effect->usb_duration - effect->usb_fadeTime);
+						fadeTime = UsbUint16ToMidiUint14_Time(effect->usb_duration - effect->usb_fadeTime);
 					} else {
-						midi_data->fadeTime = midi_data->duration;
+						fadeTime = midi_data->duration;
 					}
 				}
 			}
+			FfbproUpdate(effect, 0x60, fadeTime);
 
 			// Gain and its effects (magnitude and envelope levels)
 			bool gain_changed = (effect->usb_gain != data->gain);
@@ -642,39 +732,20 @@ int FfbproSetEffect(
 //				LogBinary(&data->gain, 1);
 
 				effect->usb_gain = data->gain;
-				midi_data->attackLevel = CalcGain(effect->usb_attackLevel, data->gain);
-				midi_data->fadeLevel = CalcGain(effect->usb_fadeLevel, data->gain);
+				FfbproUpdate(effect, 0x64, CalcGain(effect->usb_attackLevel, data->gain));	// attackLevel
+				FfbproUpdate(effect, 0x6C, CalcGain(effect->usb_fadeLevel, data->gain));	// fadeLevel
 
 				if (is_periodic) {
 					// Calculate min-max from magnitude and offset, since magnitude may be affected by gain we must calc them here too for periodic effects
 					uint8_t magnitude = CalcGain(effect->usb_magnitude, effect->usb_gain);	// already at MIDI-level i.e. 1/2 of USB level!
-					midi_data->param1 = UsbInt8ToMidiInt14(effect->usb_offset + magnitude); // max
-					midi_data->param2 = UsbInt8ToMidiInt14(effect->usb_offset - magnitude); // min
-					if (effect->state & MEffectState_SentToJoystick) {
-						FfbproSendModify(eid, 0x74, midi_data->param1); // TODO
-						FfbproSendModify(eid, 0x78, midi_data->param2);
-					}
+					FfbproUpdate(effect, 0x74, UsbInt8ToMidiInt14(effect->usb_offset + magnitude)); // param1 = max
+					FfbproUpdate(effect, 0x78, UsbInt8ToMidiInt14(effect->usb_offset - magnitude)); // param2 = min
 				} else {
-					midi_data->magnitude = CalcGain(effect->usb_magnitude, data->gain);
+					FfbproUpdate(effect, 0x74, CalcGain(effect->usb_magnitude, data->gain));	// magnitude
 				}
 			}
 
-			// Send data to MIDI
-			if (effect->state & MEffectState_SentToJoystick)
-			{
-				FfbproSendModify(eid, 0x48, midi_data->direction);	// TODO
-				FfbproSendModify(eid, 0x60, midi_data->fadeTime);
-				if (gain_changed) {
-					FfbproSendModify(eid, 0x6C, midi_data->fadeLevel);	// might have changed due gain
-					FfbproSendModify(eid, 0x64, midi_data->attackLevel);	// might have changed due gain
-					if (!is_periodic) {
-						FfbproSendModify(eid, 0x74, midi_data->magnitude);	// might have changed due gain
-					}
-				}
-			} else {
-				FfbSendSysEx((uint8_t*)midi_data, sizeof(FFP_MIDI_Effect_Basic));
-				effect->state |= MEffectState_SentToJoystick;
-			}
+			// Changes to an effect already in the joystick are sent by FfbproUpdate()
 		}
 		break;
 	
@@ -694,9 +765,7 @@ int FfbproSetEffect(
 				uint16_t offsetAxis0;
 				uint16_t offsetAxis1;
 			*/
-//			volatile FFP_MIDI_Effect_Spring_Inertia_Damper *midi_data = (FFP_MIDI_Effect_Spring_Inertia_Damper *) &gEffectStates[eid].data;
-			midi_data_len = sizeof(FFP_MIDI_Effect_Spring_Inertia_Damper);
-
+//			FFP_MIDI_Effect_Spring_Inertia_Damper *midi_data = (FFP_MIDI_Effect_Spring_Inertia_Damper *) &gEffectStates[eid].data;
 			// Send data to MIDI
 			if (effect->state & MEffectState_SentToJoystick) {
 			}
@@ -715,9 +784,7 @@ int FfbproSetEffect(
 				uint16_t coeffAxis0;
 				uint16_t coeffAxis1;
 			*/
-//			volatile FFP_MIDI_Effect_Friction *midi_data = (FFP_MIDI_Effect_Friction *) &gEffectStates[eid].data;
-			midi_data_len = sizeof(FFP_MIDI_Effect_Friction);
-
+//			FFP_MIDI_Effect_Friction *midi_data = (FFP_MIDI_Effect_Friction *) &gEffectStates[eid].data;
 			// Send data to MIDI
 			if (effect->state & MEffectState_SentToJoystick) {
 			}
@@ -738,7 +805,7 @@ int FfbproSetEffect(
 
 void FfbproCreateNewEffect(
 	USB_FFBReport_CreateNewEffect_Feature_Data_t* inData,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 	/*
 	USB effect data:
@@ -749,7 +816,17 @@ void FfbproCreateNewEffect(
 
 	// Set defaults to the effect data
 
-	volatile FFP_MIDI_Effect_Basic *midi_data = (volatile FFP_MIDI_Effect_Basic *)&effect->data;
+	FFP_MIDI_Effect_Basic *midi_data = (FFP_MIDI_Effect_Basic *)effect->data;
+
+	// Constants
+	midi_data->command = 0x23;
+	midi_data->unknown1 = 0x7F;
+	midi_data->triggerButton = 0x0000;
+
+	// Conditions have only the coefficients and offsets after these, and only
+	// a slot of that size (see FfbEffectDataSize())
+	if (FfbproEffectDataLength(inData->effectType) < sizeof(FFP_MIDI_Effect_Basic))
+		return;
 
 	midi_data->magnitude = 0x7f;
 	midi_data->frequency = 0x0001;
@@ -757,11 +834,6 @@ void FfbproCreateNewEffect(
 	midi_data->attackTime = 0x0000;
 	midi_data->fadeLevel = 0x00;
 	midi_data->fadeTime = 0x0000;
-	
-	// Constants
-	midi_data->command = 0x23;
-	midi_data->unknown1 = 0x7F;
-	midi_data->triggerButton = 0x0000;
 	midi_data->gain = 0x7F;
 	midi_data->sampleRate = 0x0064;
 	midi_data->truncate = 0x4E10;
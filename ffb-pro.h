@@ -59,18 +59,22 @@ void FfbproSetAutoCenter(uint8_t enable);
 
 void FfbproStartEffect(uint8_t id);
 void FfbproStopEffect(uint8_t id);
+void FfbproStopAllEffects(void);
 void FfbproFreeEffect(uint8_t id);
 
-void FfbproModifyDuration(uint8_t effectId, uint16_t duration);
+void FfbproModifyDuration(uint8_t effectId, TEffectState* effect, uint16_t duration);
+void FfbproFlushModify(uint8_t effectId, TEffectState* effect);
+void FfbproSetDownloadIndex(TEffectState* effect, uint8_t index);
 
-void FfbproSetEnvelope(USB_FFBReport_SetEnvelope_Output_Data_t* data, volatile TEffectState* effect);
-void FfbproSetCondition(USB_FFBReport_SetCondition_Output_Data_t* data, volatile TEffectState* effect);
-void FfbproSetPeriodic(USB_FFBReport_SetPeriodic_Output_Data_t* data, volatile TEffectState* effect);
-void FfbproSetConstantForce(USB_FFBReport_SetConstantForce_Output_Data_t* data, volatile TEffectState* effect);
-void FfbproSetRampForce(USB_FFBReport_SetRampForce_Output_Data_t* data, volatile TEffectState* effect);
-int  FfbproSetEffect(USB_FFBReport_SetEffect_Output_Data_t *data, volatile TEffectState* effect);
-void FfbproCreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData, volatile TEffectState* effect);
+void FfbproSetEnvelope(USB_FFBReport_SetEnvelope_Output_Data_t* data, TEffectState* effect);
+void FfbproSetCondition(USB_FFBReport_SetCondition_Output_Data_t* data, TEffectState* effect);
+void FfbproSetPeriodic(USB_FFBReport_SetPeriodic_Output_Data_t* data, TEffectState* effect);
+void FfbproSetConstantForce(USB_FFBReport_SetConstantForce_Output_Data_t* data, TEffectState* effect);
+void FfbproSetRampForce(USB_FFBReport_SetRampForce_Output_Data_t* data, TEffectState* effect);
+int  FfbproSetEffect(USB_FFBReport_SetEffect_Output_Data_t *data, TEffectState* effect);
+void FfbproCreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData, TEffectState* effect);
 
 uint8_t FfbproUsbToMidiEffectType(uint8_t usb_effect_type);
+uint8_t FfbproEffectDataLength(uint8_t usb_effect_type);
 
 #endif // _FFB_PRO_
\ No newline at end of file
@@ -23,6 +23,7 @@
 
 #include "ffb-wheel.h"
 
+#include <stddef.h>
 #include <LUFA/Drivers/Board/LEDs.h>
 #include <util/delay.h>
 
@@ -49,6 +50,33 @@ uint8_t FfbwheelUsbToMidiEffectType(uint8_t usb_effect_type)
 	return usbToMidiEffectType[usb_effect_type];
 }
 
+uint8_t FfbwheelEffectDataLength(uint8_t usb_effect_type)
+{
+	switch (usb_effect_type)
+	{
+	case USB_EFFECT_SQUARE:
+	case USB_EFFECT_SINE:
+	case USB_EFFECT_TRIANGLE:
+	case USB_EFFECT_SAWTOOTHDOWN:
+	case USB_EFFECT_SAWTOOTHUP:
+	case USB_EFFECT_RAMP:
+		return sizeof(cmd_f0_wave_t);
+
+	case USB_EFFECT_CONSTANT:
+		return sizeof(cmd_f0_constant_force_t);
+
+	case USB_EFFECT_SPRING:
+	case USB_EFFECT_DAMPER:
+	case USB_EFFECT_INERTIA:
+	case USB_EFFECT_FRICTION:
+		return sizeof(cmd_f0_friction_t);
+
+	case USB_EFFECT_CUSTOM:
+	default:
+		return 0;
+	}
+}
+
 /**
  * Initialize wheel for FF. Releases spring effect.
  *
@@ -90,10 +118,10 @@ void FfbwheelSetAutoCenter(uint8_t enable)
 		0xf3, 0x6a
 	};
 
-	FfbSendData(ac_enable, sizeof(ac_enable));
+	FfbSendOperation(0, ac_enable, sizeof(ac_enable));
 	
 	if (!enable) {
-		FfbSendData(ac_disable, sizeof(ac_disable));
+		FfbSendOperation(0, ac_disable, sizeof(ac_disable));
 	}
 }
 
@@ -120,7 +148,7 @@ static void FfbwheelSendEffectOper(uint8_t effectId, uint8_t operation)
 	op.operation_and_checksum &= 0xf0;
 	op.operation_and_checksum |= sum;
 	
-	FfbSendData((const uint8_t*)&op, sizeof(op));
+	FfbSendOperation(effectId, (const uint8_t*)&op, sizeof(op));
 }
 
 void FfbwheelStartEffect(uint8_t effectId)
@@ -153,47 +181,54 @@ static void FfbwheelSendModify(uint8_t effectId, uint8_t address, uint16_t value
 	uint8_t sum = d[0] + (d[2] & ~0x40) + d[3] + d[4] + d[5];
 	op.checksum = (0x80 - sum) & 0x7f;
 	
-	FfbSendData(d, sizeof(op));
+	FfbSendEffectData(effectId, d, sizeof(op));
 }
 
-void FfbwheelModifyDuration(uint8_t effectId, uint16_t duration)
+void FfbwheelModifyDuration(uint8_t effectId, TEffectState* effect, uint16_t duration)
 {
+	FfbSetEffectWord(effect, offsetof(midi_data_common_t, duration), duration);
 	FfbwheelSendModify(effectId, 0x00, duration);
 }
 
+void FfbwheelFlushModify(uint8_t effectId, TEffectState* effect)
+{
+	// Modifications are sent immediately to the wheel, nothing to flush
+	effect->dirty = 0;
+}
+
 void FfbwheelSetEnvelope(
 	USB_FFBReport_SetEnvelope_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 }
 
 void FfbwheelSetCondition(
 	USB_FFBReport_SetCondition_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 }
 
 void FfbwheelSetPeriodic(
 	USB_FFBReport_SetPeriodic_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 }
 
 void FfbwheelSetConstantForce(
 	USB_FFBReport_SetConstantForce_Output_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
 }
 
 void FfbwheelSetRampForce(
 	USB_FFBReport_SetRampForce_Output_Data_t* data,
-	volatile TEffectState* e)
+	TEffectState* e)
 {
 }
 
 int FfbwheelSetEffect(
 	USB_FFBReport_SetEffect_Output_Data_t *data,
-	volatile TEffectState* e)
+	TEffectState* e)
 {
 	/*
 	USB effect data:
@@ -210,7 +245,7 @@ int FfbwheelSetEffect(
 		uint8_t	directionY;	// angle (0=0 .. 180=0..360deg)
 	*/
    
-	uint8_t midi_data_len = 0;
+	uint8_t midi_data_len = FfbwheelEffectDataLength(data->effectType);
    
 	switch (data->effectType)
 	{
@@ -221,14 +256,12 @@ int FfbwheelSetEffect(
 	case USB_EFFECT_SAWTOOTHUP:
 	case USB_EFFECT_RAMP:
 	{
-		midi_data_len = sizeof(cmd_f0_wave_t);
 		cmd_f0_wave_t* midi_data = (cmd_f0_wave_t*)e->data;
 	}
 	break;
 	
 	case USB_EFFECT_CONSTANT:
 	{
-		midi_data_len = sizeof(cmd_f0_constant_force_t);
 		cmd_f0_constant_force_t* midi_data = (cmd_f0_constant_force_t*)e->data;
 	}
 	break;
@@ -239,7 +272,6 @@ int FfbwheelSetEffect(
 	
 	case USB_EFFECT_FRICTION:
 	{
-		midi_data_len = sizeof(cmd_f0_friction_t);
 		cmd_f0_friction_t* midi_data = (cmd_f0_friction_t*)e->data;
 	}
 	break;
@@ -256,9 +288,9 @@ int FfbwheelSetEffect(
 
 void FfbwheelCreateNewEffect(
 	USB_FFBReport_CreateNewEffect_Feature_Data_t* data,
-	volatile TEffectState* effect)
+	TEffectState* effect)
 {
-	cmd_f0_common_t* c = (cmd_f0_common_t*)&effect->data;
+	cmd_f0_common_t* c = (cmd_f0_common_t*)effect->data;
 	c->command = 0x20; // always 0x20
 	c->unknown = 0x7f; // always 0x7f
 	c->direction = 0x00; // 0 for effect not using direction
@@ -27,7 +27,9 @@
 
 #include "ffb.h"
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <avr/io.h>
 #include <util/delay.h>
 #include <LUFA/Drivers/Board/LEDs.h>
@@ -48,9 +50,11 @@ const FFB_Driver ffb_drivers[2] =
 		.GetSysExHeader = FfbproGetSysExHeader,
 		.SetAutoCenter = FfbproSetAutoCenter,
 		.UsbToMidiEffectType = FfbproUsbToMidiEffectType,
+		.EffectDataLength = FfbproEffectDataLength,
 		.StartEffect = FfbproStartEffect,
 		.StopEffect = FfbproStopEffect,
 		.FreeEffect = FfbproFreeEffect,
+		.StopAllEffects = FfbproStopAllEffects,
 		.CreateNewEffect = FfbproCreateNewEffect,
 		.SetEnvelope = FfbproSetEnvelope,
 		.SetCondition = FfbproSetCondition,
@@ -59,12 +63,15 @@ const FFB_Driver ffb_drivers[2] =
 		.SetRampForce = FfbproSetRampForce,
 		.SetEffect = FfbproSetEffect,
 		.ModifyDuration = FfbproModifyDuration,
+		.FlushModify = FfbproFlushModify,
+		.SetDownloadIndex = FfbproSetDownloadIndex,
 		},
 		{
 		.EnableInterrupts = FfbwheelEnableInterrupts,
 		.GetSysExHeader = FfbwheelGetSysExHeader,
 		.SetAutoCenter = FfbwheelSetAutoCenter,
 		.UsbToMidiEffectType = FfbwheelUsbToMidiEffectType,
+		.EffectDataLength = FfbwheelEffectDataLength,
 		.StartEffect = FfbwheelStartEffect,
 		.StopEffect = FfbwheelStopEffect,
 		.FreeEffect = FfbwheelFreeEffect,
@@ -76,120 +83,770 @@ const FFB_Driver ffb_drivers[2] =
 		.SetRampForce = FfbwheelSetRampForce,
 		.SetEffect = FfbwheelSetEffect,
 		.ModifyDuration = FfbwheelModifyDuration,
+		.FlushModify = FfbwheelFlushModify,
 		}
 	};
 
 static const FFB_Driver* ffb;
 
 // Effect management
-volatile uint8_t nextEID = 2;	// FFP effect indexes starts from 2 (yes, we waste memory for two effects...)
-volatile USB_FFBReport_PIDStatus_Input_Data_t pidState;	// For holding device status flags
+//
+// The effect state below is changed only by the main loop, which handles both
+// the queued FFB reports and the control requests. So it is not volatile.
+USB_FFBReport_PIDStatus_Input_Data_t pidState;	// For holding device status flags
+
+static TEffectState gEffectStates[MAX_EFFECTS+1];	// one for each effect (array index 0 is unused to simplify things)
+
+// Sets of effects as bitmaps: bit (id-1) stands for effect block index id.
+// Bulk operations go through the set bits only, lowest index first.
+#if MAX_EFFECTS <= 32
+typedef uint32_t TEffectMask;
+#define EffectMaskFirst(mask)	ffsl(mask)	// lowest effect block index in the set, 0 if empty
+#else
+typedef uint64_t TEffectMask;
+#define EffectMaskFirst(mask)	ffsll(mask)
+#endif
+#define EffectBit(id)	((TEffectMask) 1 << ((id) - 1))
+
+#define EFFECTS_ALL	((TEffectMask) ~0 >> (sizeof(TEffectMask) * 8 - MAX_EFFECTS))
+
+// FFP effect indexes start from 2 (yes, we waste memory for two effects...)
+#define EFFECTS_JOYSTICK	(EFFECTS_ALL & ~EffectBit(1))
+
+// The first of them is kept for the direct force effect, see FfbHandle_DirectForce().
+// It is not in the host's pool, so the host's operations leave it alone.
+#define DIRECT_FORCE_ID	2
+#define EFFECTS_ALLOCATABLE	(EFFECTS_JOYSTICK & ~EffectBit(DIRECT_FORCE_ID))
+
+// The effects by state, kept in step with the <state> of each effect by
+// SetEffectState() and ClearEffectState(). The free ones are those that are
+// allocatable but not allocated.
+static TEffectMask gAllocatedEffects = 0;
+static TEffectMask gSentEffects = 0;
+static TEffectMask gPlayingEffects = 0;
+static TEffectMask gRedownloadEffects = 0;
+
+// Effects that the host has started but that cannot be sent to the joystick
+// yet, see PrepareStart(). FfbService() starts them once they can.
+static TEffectMask gStartPendingEffects = 0;
+
+// What the host has been told with PID State reports, see FfbGetPidState()
+static uint8_t gReportedStatus = 0;
+static TEffectMask gReportedPlaying = 0;
+static uint8_t gNextPidStateId = 1;	// where to continue looking for changes, so that all effects get their turn
+
+// MIDI data pool, see FFB_DATA_UNIT_SIZE. Bit (n-1) of a unit set stands for unit n.
+#if FFB_DATA_UNITS > 32
+#error The unit sets of the MIDI data pool hold 32 units at most
+#endif
+#if 2 * FFB_DATA_UNIT_SIZE < MAX_MIDI_MSG_LEN
+#error Two MIDI data units must hold the data of any effect
+#endif
+#define DATA_UNITS_ALL	((uint32_t) ~0 >> (32 - FFB_DATA_UNITS))
+
+static uint8_t gEffectData[FFB_DATA_UNITS][FFB_DATA_UNIT_SIZE];
+static uint32_t gFreeDataUnits = DATA_UNITS_ALL;
+static uint32_t gDoubleDataUnits = 0;	// first units of the effects that take two units
+
+static void SetEffectState(uint8_t id, uint8_t flags)
+	{
+	TEffectMask bit = EffectBit(id);
+
+	gEffectStates[id].state |= flags;
+	if (flags & MEffectState_Allocated)
+		gAllocatedEffects |= bit;
+	if (flags & MEffectState_SentToJoystick)
+		gSentEffects |= bit;
+	if (flags & MEffectState_Playing)
+		gPlayingEffects |= bit;
+	if (flags & MEffectState_Redownload)
+		gRedownloadEffects |= bit;
+	}
+
+static void ClearEffectState(uint8_t id, uint8_t flags)
+	{
+	TEffectMask bit = EffectBit(id);
+
+	gEffectStates[id].state &= ~flags;
+	if (flags & MEffectState_Allocated)
+		gAllocatedEffects &= ~bit;
+	if (flags & MEffectState_SentToJoystick)
+		gSentEffects &= ~bit;
+	if (flags & MEffectState_Playing)
+		gPlayingEffects &= ~bit;
+	if (flags & MEffectState_Redownload)
+		gRedownloadEffects &= ~bit;
+	}
 
-void SendPidStateForEffect(uint8_t eid, uint8_t effectState);
-void SendPidStateForEffect(uint8_t eid, uint8_t effectState)
+// Returns the lowest effect in <set> from <id> on, wrapping around to the
+// lowest one in the set. Returns 0 if the set is empty.
+static uint8_t EffectMaskNext(TEffectMask set, uint8_t id)
 	{
-	pidState.effectBlockIndex = effectState;
+	TEffectMask later = set & ~(EffectBit(id) - 1);
+	return EffectMaskFirst(later ? later : set);
+	}
+
+// Milliseconds from the USB frame number, for timing the effects that stop by themselves
+static uint16_t gTimeMs = 0;
+static uint16_t gLastFrame = 0;
 
-	pidState.effectBlockIndex = 0;
+static void UpdateTime(void)
+	{
+	uint16_t frame = USB_Device_GetFrameNumber();
+	gTimeMs += (frame - gLastFrame) & 0x7FF;	// frame numbers are 11 bits
+	gLastFrame = frame;
 	}
 
-static volatile TEffectState gEffectStates[MAX_EFFECTS+1];	// one for each effect (array index 0 is unused to simplify things)
+uint8_t FfbGetPidState(USB_FFBReport_PIDStatus_Input_Data_t *report)
+	{
+	// The direct force effect is the device's own, the host does not know its index
+	TEffectMask playingEffects = gPlayingEffects & EFFECTS_ALLOCATABLE;
+	report->status = pidState.status;
+
+	report->reportId = 2;
+
+	uint8_t id = EffectMaskNext(playingEffects ^ gReportedPlaying, gNextPidStateId);
+	if (id)
+		{
+		gNextPidStateId = (id >= MAX_EFFECTS) ? 1 : id + 1;
+
+		uint8_t playing = (playingEffects & EffectBit(id)) ? 1 : 0;
+		gReportedPlaying ^= EffectBit(id);
+		gReportedStatus = report->status;
+		report->effectBlockIndex = (id << 1) | playing;
+		return 1;
+		}
+
+	if (report->status != gReportedStatus)
+		{
+		gReportedStatus = report->status;
+		report->effectBlockIndex = 0;
+		return 1;
+		}
+
+	return 0;
+	}
 
-volatile TDisabledEffectTypes gDisabledEffects;
+TDisabledEffectTypes gDisabledEffects;
 
-uint8_t GetNextFreeEffect(void);
-void StartEffect(uint8_t id);
+uint8_t GetNextFreeEffect(TEffectMask from, uint8_t dataLength);
+void StartEffect(uint8_t id, uint8_t loopCount);
 void StopEffect(uint8_t id);
 void StopAllEffects(void);
 void FreeEffect(uint8_t id);
 void FreeAllEffects(void);
+static void FfbDownloadEffect(uint8_t id);
 
 void FfbSetDriver(uint8_t id)
 {
 	ffb = &ffb_drivers[id];
 }
 
-uint8_t GetNextFreeEffect(void)
+// Bit of the first MIDI data unit of the given effect data
+static uint32_t DataUnitBit(uint8_t* data)
 	{
-	if (nextEID == MAX_EFFECTS)
+	return 1ul << ((data - &gEffectData[0][0]) / FFB_DATA_UNIT_SIZE);
+	}
+
+uint8_t FfbEffectDataSize(TEffectState* effect)
+	{
+	if (!effect->data)
+		return 0;
+	return (gDoubleDataUnits & DataUnitBit(effect->data)) ? MAX_MIDI_MSG_LEN : FFB_DATA_UNIT_SIZE;
+	}
+
+// Take cleared units for MIDI data of the given length.
+// Returns 0 if there are not enough free units.
+static uint8_t* AllocEffectData(uint8_t length)
+	{
+	uint32_t freeUnits = gFreeDataUnits;
+	uint8_t unit;
+
+	if (length <= FFB_DATA_UNIT_SIZE)
+		{
+		// Rather a unit between used ones, to leave the free pairs for two-unit effects
+		uint32_t single = freeUnits & ~(freeUnits >> 1) & ~(freeUnits << 1);
+		unit = ffsl(single ? single : freeUnits);
+		if (unit == 0)
+			return 0;
+		gFreeDataUnits &= ~(1ul << (unit - 1));
+		length = FFB_DATA_UNIT_SIZE;
+		}
+	else if (length <= MAX_MIDI_MSG_LEN)
+		{
+		unit = ffsl(freeUnits & (freeUnits >> 1));	// first of two free units in a row
+		if (unit == 0)
+			return 0;
+		gFreeDataUnits &= ~(3ul << (unit - 1));
+		gDoubleDataUnits |= 1ul << (unit - 1);
+		length = 2 * FFB_DATA_UNIT_SIZE;
+		}
+	else
 		return 0;
 
-	uint8_t id = nextEID++;
+	uint8_t* data = gEffectData[unit - 1];
+	memset(data, 0, length);
+	return data;
+	}
+
+static void FreeEffectData(uint8_t* data)
+	{
+	if (!data)
+		return;
 
-	// Find the next free effect ID for next time
-	while (gEffectStates[nextEID].state != 0)
+	uint32_t bit = DataUnitBit(data);
+	if (gDoubleDataUnits & bit)
 		{
-		if (nextEID >= MAX_EFFECTS)
-			break;	// the last spot was taken
-		nextEID++;
+		gDoubleDataUnits &= ~bit;
+		bit |= bit << 1;
 		}
+	gFreeDataUnits |= bit;
+	}
 
-	gEffectStates[id].state = MEffectState_Allocated;
-	memset((void*) &gEffectStates[id].data, 0, sizeof(gEffectStates[id].data));
+// Allocate the lowest free effect of the given set with room for MIDI data of
+// the given length. Returns the effect block index or 0 if there is no room.
+uint8_t GetNextFreeEffect(TEffectMask from, uint8_t dataLength)
+	{
+	uint8_t id = EffectMaskFirst(from & ~gAllocatedEffects);
+	if (id == 0)
+		return 0;
+
+	uint8_t* data = AllocEffectData(dataLength);
+	if (!data)
+		return 0;
+
+	SetEffectState(id, MEffectState_Allocated);
+	gEffectStates[id].dirty = 0;
+	gEffectStates[id].length = 0;
+	gEffectStates[id].data = data;
 		
 	return id;
 	}
 
+// Stops the host's effects that are playing. Stopping a single effect takes as
+// many MIDI bytes as stopping all effects at once, so when the driver can do it,
+// more than one playing effect is stopped with a single "stop all". Not while
+// the direct force effect plays, since it must keep playing.
 void StopAllEffects(void)
 	{
-	for (uint8_t id = 1; id <= MAX_EFFECTS; id++)
-		StopEffect(id);
+	TEffectMask playing = gPlayingEffects & EFFECTS_ALLOCATABLE;
+	TEffectMask stopping = 0;
+
+	for (TEffectMask set = playing; set; set &= set - 1)
+		{
+		uint8_t id = EffectMaskFirst(set);
+		if (!FfbEffectDisabled(id))
+			stopping |= EffectBit(id);
+		}
+
+	if (!ffb->StopAllEffects || (stopping & (stopping - 1)) == 0 ||
+		(gPlayingEffects & EffectBit(DIRECT_FORCE_ID)))
+		{
+		for (TEffectMask set = playing; set; set &= set - 1)
+			StopEffect(EffectMaskFirst(set));
+		return;
+		}
+
+	for (TEffectMask set = playing; set; set &= set - 1)
+		ClearEffectState(EffectMaskFirst(set), MEffectState_Playing);
+	ffb->StopAllEffects();
 	}
 
-void StartEffect(uint8_t id)
+// Mark the effect playing <loopCount> times (0 is taken as 1)
+void StartEffect(uint8_t id, uint8_t loopCount)
 	{
+	if (id == 0xFF)
+		{
+		// All effects in the joystick
+		for (TEffectMask set = gSentEffects; set; set &= set - 1)
+			StartEffect(EffectMaskFirst(set), loopCount);
+		return;
+		}
+
 	if (id > MAX_EFFECTS)
 		return;
-	gEffectStates[id].state |= MEffectState_Playing;
+
+	TEffectState* effect = &gEffectStates[id];
+	SetEffectState(id, MEffectState_Playing);
+
+	// The joystick stops a finite effect by itself when its duration is over.
+	// It does not know of loop counts, so UpdatePlayingEffects() starts the
+	// effect again for each further loop. The Set Effect report has no start
+	// delay (see the HID descriptor), so the effect starts right away.
+	// Infinite durations (USB_DURATION_INFINITE and above) never time out.
+	if (effect->usb_duration != 0 && effect->usb_duration < USB_DURATION_INFINITE)
+		{
+		UpdateTime();
+		effect->playEnd = gTimeMs + effect->usb_duration;
+		effect->loopsLeft = (loopCount > 1) ? loopCount - 1 : 0;
+		SetEffectState(id, MEffectState_Timed);
+		}
+	else
+		ClearEffectState(id, MEffectState_Timed);
+	}
+
+// Clear the playing state of the finite effects that the joystick has already
+// stopped, and have StartPendingEffects() start again the ones with loops left
+static void UpdatePlayingEffects(void)
+	{
+	UpdateTime();
+
+	for (TEffectMask set = gPlayingEffects; set; set &= set - 1)
+		{
+		uint8_t id = EffectMaskFirst(set);
+		TEffectState* effect = &gEffectStates[id];
+		if (!(effect->state & MEffectState_Timed) || (int16_t) (gTimeMs - effect->playEnd) < 0)
+			continue;
+
+		if (effect->loopsLeft == 0)
+			{
+			ClearEffectState(id, MEffectState_Playing | MEffectState_Timed);
+			continue;
+			}
+
+		if (effect->loopsLeft != USB_LOOP_COUNT_INFINITE)
+			effect->loopsLeft--;
+		effect->playEnd += effect->usb_duration;
+		gStartPendingEffects |= EffectBit(id);
+		}
 	}
 
 void StopEffect(uint8_t id)
 	{
-	if (id > MAX_EFFECTS)
+	if (id == 0 || id > MAX_EFFECTS)
 		return;
-	gEffectStates[id].state &= ~MEffectState_Playing;
-	if (!gDisabledEffects.effectId[id])
+	ClearEffectState(id, MEffectState_Playing);
+	if (!FfbEffectDisabled(id))
 		ffb->StopEffect(id);
 	}
 
 void FreeEffect(uint8_t id)
 	{
-	if (id > MAX_EFFECTS)
+	if (id == 0 || id > MAX_EFFECTS)
 		return;
 
-	gEffectStates[id].state = 0;
-	if (id < nextEID)
-		nextEID = id;
+	uint8_t inJoystick = gEffectStates[id].state & MEffectState_SentToJoystick;
+
+	ClearEffectState(id, 0xFF);
+	gEffectStates[id].dirty = 0;	// no point sending changes to a freed effect
+	gEffectStates[id].length = 0;
+	FreeEffectData(gEffectStates[id].data);
+	gEffectStates[id].data = 0;
 		
-	ffb->FreeEffect(id);
+	if (inJoystick)
+		ffb->FreeEffect(id);
 	}
 
 void FreeAllEffects(void)
 	{
-	nextEID = 2;
-	memset((void*) gEffectStates, 0, sizeof(gEffectStates));
+	memset(gEffectStates, 0, sizeof(gEffectStates));
+	gAllocatedEffects = 0;
+	gSentEffects = 0;
+	gPlayingEffects = 0;
+	gRedownloadEffects = 0;
+	gStartPendingEffects = 0;
+	gFreeDataUnits = DATA_UNITS_ALL;
+	gDoubleDataUnits = 0;
+	}
+
+// Send pending modifications of the given effect e.g. before starting it
+static void FlushEffect(uint8_t id)
+	{
+	if (id > MAX_EFFECTS)
+		return;
+
+	uint16_t dirty = gEffectStates[id].dirty;
+	if (!dirty)
+		return;
+
+	for (; dirty; dirty &= dirty - 1)
+		gMidiStats.modifiesSent++;
+	ffb->FlushModify(id, &gEffectStates[id]);
+	}
+
+static void FlushAllEffects(void)
+	{
+	for (TEffectMask set = gSentEffects; set; set &= set - 1)
+		FlushEffect(EffectMaskFirst(set));
+	}
+
+// MIDI message classes, see FfbMidiTransmitNext()
+#define MIDI_QUEUE_BULK	0	// effect downloads and modifications
+#define MIDI_QUEUE_HIGH	1	// effect operations and device control
+
+static void FfbMidiQueueBytes(uint8_t queue, const uint8_t *data, uint16_t len);
+static void FfbMidiCommit(uint8_t queue, uint8_t effectId);
+
+// Returns true if <messages> more messages of <bytes> bytes in total fit in
+// the queue. FfbMidiQueueBytes() and FfbMidiCommit() wait for room when there
+// is none, so the main loop checks for room first and leaves the work for a
+// later pass instead.
+static uint8_t FfbMidiRoom(uint8_t queue, uint8_t bytes, uint8_t messages);
+
+#define MIDI_MODIFY_SIZE	6	// bytes in an effect modification, see FfbproSendModify()
+#define MIDI_OPERATION_SIZE	3	// bytes in an effect operation, see FfbproSendEffectOper()
+
+// Room for the messages that a single output report makes right away, e.g.
+// stopping an effect while another one is started
+#define MIDI_REPORT_HIGH_ROOM	(2 * MIDI_OPERATION_SIZE)
+
+// Send the effect to the joystick into its own effect block index, replacing
+// any effect in that index. Only for drivers with SetDownloadIndex.
+//
+// Left to itself, the joystick puts a new effect into its lowest free index.
+// With the Pro, the effect is placed explicitly instead, so the effects can be
+// sent in any order. The wheel is not known to honour the index, so there the
+// effects are sent plainly and in index order, see EffectsBelowMissing().
+static void FfbPlaceEffect(uint8_t id)
+	{
+	TEffectState* effect = &gEffectStates[id];
+
+	ffb->SetDownloadIndex(effect, id);
+	FfbDownloadEffect(id);
+	ffb->SetDownloadIndex(effect, 0x7F);
+	}
+
+// Send the effect to the joystick the way the driver allows, see FfbPlaceEffect()
+static void FfbSendEffect(uint8_t id)
+	{
+	if (ffb->SetDownloadIndex)
+		FfbPlaceEffect(id);
+	else
+		FfbDownloadEffect(id);
+	}
+
+// The effects that must be sent before the given one, in index order, for it
+// to get its own index in the joystick. Returns EFFECTS_ALL if that cannot be
+// done now: a lower index is free or its effect is not set up yet.
+static TEffectMask EffectsBelowMissing(uint8_t id)
+	{
+	if (ffb->SetDownloadIndex)
+		return 0;	// placed explicitly
+
+	TEffectMask bit = EffectBit(id);
+	TEffectMask missing = EFFECTS_JOYSTICK & ~gSentEffects & (bit - 1);
+	for (TEffectMask set = missing; set; set &= set - 1)
+		{
+		uint8_t lower = EffectMaskFirst(set);
+		if (!(gAllocatedEffects & EffectBit(lower)) || gEffectStates[lower].length == 0)
+			return EFFECTS_ALL;
+		}
+	return missing;
+	}
+
+// Background downloader.
+//
+// Set up effects are sent to the joystick while the MIDI link is idle, so that
+// starting them later needs only the short start command.
+static void DownloadNextEffect(void)
+	{
+	if (FfbMidiBufferUsed() != 0)
+		return;
+
+	for (TEffectMask set = gAllocatedEffects & ~gSentEffects; set; set &= set - 1)
+		{
+		uint8_t id = EffectMaskFirst(set);
+		if (gEffectStates[id].length && EffectsBelowMissing(id) == 0)
+			{
+			FfbSendEffect(id);	// one at a time, the rest on later passes
+			return;
+			}
+
+		if (!ffb->SetDownloadIndex)
+			return;	// the higher indexes must wait for this one
+		}
+	}
+
+void FfbRequestRedownload(TEffectState* effect)
+	{
+	if (ffb->SetDownloadIndex && (effect->state & MEffectState_SentToJoystick))
+		SetEffectState(effect - gEffectStates, MEffectState_Redownload);
+	}
+
+// Sends again an effect that has changed in a way that cannot be modified in
+// the joystick. The new version replaces the old one in its index and is
+// restarted if it was playing. Only drivers with SetDownloadIndex ask for this. To not flood the MIDI link, this is done only
+// when the link is idle and only for one effect at a time. Further changes in
+// the meantime are included in the same download.
+static void RedownloadNextEffect(void)
+	{
+	if (FfbMidiBufferUsed() != 0 || gRedownloadEffects == 0)
+		return;
+
+	uint8_t id = EffectMaskFirst(gRedownloadEffects);
+	TEffectState* effect = &gEffectStates[id];
+
+	ClearEffectState(id, MEffectState_Redownload);
+	gMidiStats.redownloads++;
+
+	FfbPlaceEffect(id);	// replaces the old version
+
+	if ((effect->state & MEffectState_Playing) && !FfbEffectDisabled(id))
+		ffb->StartEffect(id);
+	}
+
+// Number of modifications waiting in the effect's <dirty>
+static uint8_t EffectModifies(uint8_t id)
+	{
+	uint8_t modifies = 0;
+	for (uint16_t dirty = gEffectStates[id].dirty; dirty; dirty &= dirty - 1)
+		modifies++;
+	return modifies;
+	}
+
+// Make sure the given effect is in the joystick before it is started, with
+// the lower effects that must go first (see EffectsBelowMissing()).
+// Returns 0 if that cannot be done now: an effect is not set up yet, or the
+// downloads and the start do not fit in the MIDI buffer.
+static uint8_t DownloadBeforeStart(uint8_t id)
+	{
+	TEffectMask bit = EffectBit(id);
+	if (gSentEffects & bit)
+		{
+		gMidiStats.startsResident++;
+		return 1;
+		}
+
+	TEffectMask missing = EffectsBelowMissing(id);
+	if (missing == EFFECTS_ALL || gEffectStates[id].length == 0)
+		return 0;
+	missing |= bit;
+
+	uint8_t hdr_len;
+	ffb->GetSysExHeader(&hdr_len);
+
+	uint16_t bytes = MIDI_OPERATION_SIZE;	// the start may follow the downloads in the bulk queue
+	uint8_t messages = 1;
+	for (TEffectMask set = missing; set; set &= set - 1)
+		{
+		TEffectState* effect = &gEffectStates[EffectMaskFirst(set)];
+		bytes += hdr_len + effect->length + sizeof(effect->sysexEnd);
+		messages++;
+		}
+
+	if (bytes > 0xFF || !FfbMidiRoom(MIDI_QUEUE_BULK, bytes, messages))
+		return 0;
+
+	for (TEffectMask set = missing; set; set &= set - 1)
+		FfbSendEffect(EffectMaskFirst(set));
+	gMidiStats.startsDownloaded++;
+	return 1;
+	}
+
+// Get an effect that StartEffect() has marked playing ready to be started in
+// the joystick: downloaded and with its latest parameters. Returns 0 and
+// leaves the start to FfbService() if that cannot be done now.
+static uint8_t PrepareStart(uint8_t id)
+	{
+	TEffectMask bit = EffectBit(id);
+	uint8_t modifies = EffectModifies(id);
+
+	if (!FfbMidiRoom(MIDI_QUEUE_HIGH, MIDI_OPERATION_SIZE, 1) ||
+		!FfbMidiRoom(MIDI_QUEUE_BULK, modifies * MIDI_MODIFY_SIZE + MIDI_OPERATION_SIZE, modifies + 1) ||
+		!DownloadBeforeStart(id))
+		{
+		gStartPendingEffects |= bit;
+		return 0;
+		}
+
+	gStartPendingEffects &= ~bit;
+	FlushEffect(id);
+	return 1;
+	}
+
+static void SendStart(uint8_t id)
+	{
+	if (!FfbEffectDisabled(id))
+		ffb->StartEffect(id);
+	}
+
+// Start the given allocated effect
+static void PlayEffect(uint8_t id, uint8_t loopCount)
+	{
+	if (id == 0 || id > MAX_EFFECTS || !(gAllocatedEffects & EffectBit(id)))
+		return;
+
+	StartEffect(id, loopCount);
+	if (PrepareStart(id))
+		SendStart(id);
+	}
+
+// Start all the host's effects that are set up: the ones in the joystick with a
+// single "start all", the others one by one once they have been downloaded.
+static void PlayAllEffects(uint8_t loopCount)
+	{
+	for (TEffectMask set = gAllocatedEffects & EFFECTS_ALLOCATABLE; set; set &= set - 1)
+		{
+		uint8_t id = EffectMaskFirst(set);
+		if (gEffectStates[id].length == 0)
+			continue;
+
+		StartEffect(id, loopCount);
+		if (!(gSentEffects & EffectBit(id)))
+			gStartPendingEffects |= EffectBit(id);
+		}
+
+	FlushAllEffects();
+	ffb->StartEffect(0x7F);
+	}
+
+// Start the effects that could not be started when the host asked, in index order
+static void StartPendingEffects(void)
+	{
+	gStartPendingEffects &= gPlayingEffects;	// stopped or freed meanwhile
+
+	for (TEffectMask set = gStartPendingEffects; set; set &= set - 1)
+		{
+		uint8_t id = EffectMaskFirst(set);
+		if (PrepareStart(id))
+			SendStart(id);
+		}
+	}
+
+// Rate governor for streamed effect changes.
+//
+// Hosts may update e.g. the constant force magnitude hundreds of times per
+// second, which is far more than the MIDI link can carry. While the MIDI
+// backlog is above the high-water mark the pending modifications are held
+// back. New changes to the same parameter then just replace the pending
+// value, so only the newest value of each parameter is sent once the backlog
+// has drained below the low-water mark.
+#define MIDI_BACKLOG_HIGH_WATER	48	// bytes
+#define MIDI_BACKLOG_LOW_WATER	16	// bytes
+
+static uint8_t gThrottled = 0;
+static uint8_t gNextFlushId = 1;	// where to continue flushing, so that all effects get their turn
+
+void FfbService(void)
+	{
+	UpdatePlayingEffects();
+
+	uint8_t backlog = FfbMidiBufferUsed();
+
+	if (backlog >= MIDI_BACKLOG_HIGH_WATER)
+		gThrottled = 1;
+	else if (backlog <= MIDI_BACKLOG_LOW_WATER)
+		gThrottled = 0;
+
+	if (gThrottled)
+		{
+		gMidiStats.throttledPasses++;
+		return;
+		}
+
+	StartPendingEffects();
+
+	// Only the effects in the joystick have modifications to send
+	TEffectMask pending = gSentEffects;
+	while (pending)
+		{
+		uint8_t id = EffectMaskNext(pending, gNextFlushId);
+		pending &= ~EffectBit(id);
+
+		uint8_t modifies = EffectModifies(id);
+		if (!FfbMidiRoom(MIDI_QUEUE_BULK, modifies * MIDI_MODIFY_SIZE, modifies))
+			return;	// this one first on a later pass
+
+		gNextFlushId = (id >= MAX_EFFECTS) ? 1 : id + 1;
+		FlushEffect(id);
+
+		if (FfbMidiBufferUsed() >= MIDI_BACKLOG_HIGH_WATER)
+			return;	// the rest on a later pass
+		}
+
+	RedownloadNextEffect();
+	DownloadNextEffect();
 	}
 
 // Utilities
 
-void FfbSendSysEx(const uint8_t* midi_data, uint8_t len)
+void FfbSendSysEx(uint8_t effectId, const uint8_t* midi_data, uint8_t len)
 {	
 	uint8_t hdr_len;
 	const uint8_t*	hdr = ffb->GetSysExHeader(&hdr_len); // header includes the first 0xF0
-	FfbSendData(hdr, hdr_len);
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, hdr, hdr_len);
 	
-	FfbSendData((uint8_t*) midi_data, len);
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, (uint8_t*) midi_data, len);
 	
 	uint8_t checksum = 0;
 	while (len--)
 		checksum += *midi_data++;
 	checksum = (0x80-checksum) & 0x7f;
-	FfbSendData(&checksum, 1);
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, &checksum, 1);
 
 	uint8_t mark = 0xF7;	// SysEx End
-	FfbSendData(&mark, 1);
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, &mark, 1);
+
+	// Whole SysEx goes out as one message
+	FfbMidiCommit(MIDI_QUEUE_BULK, effectId);
 }
 
+void FfbSetEffectByte(TEffectState* effect, uint8_t offset, uint8_t value)
+	{
+	if (offset >= FfbEffectDataSize(effect))
+		return;	// not in this type of effect
+
+	uint8_t old = effect->data[offset];
+	effect->data[offset] = value;
+
+	// checksum = (0x80 - sum of data) & 0x7f
+	if (offset < effect->length)
+		effect->sysexEnd[0] = (effect->sysexEnd[0] - (uint8_t)(value - old)) & 0x7f;
+	}
+
+void FfbSetEffectWord(TEffectState* effect, uint8_t offset, uint16_t value)
+	{
+	FfbSetEffectByte(effect, offset, value & 0xFF);
+	FfbSetEffectByte(effect, offset + 1, value >> 8);
+	}
+
+// Prepare the SysEx end of the effect with the given data length.
+// From now on the data must be changed with FfbSetEffectByte/Word().
+static void FfbFrameEffect(TEffectState* effect, uint8_t len)
+	{
+	uint8_t checksum = 0;
+	for (uint8_t i = 0; i < len; i++)
+		checksum += effect->data[i];
+
+	effect->length = len;
+	effect->sysexEnd[0] = (0x80 - checksum) & 0x7f;
+	effect->sysexEnd[1] = 0xF7;	// SysEx End
+	}
+
+// Send the whole effect to joystick. The SysEx is ready in the effect state
+// apart from the header that is the same for all effects.
+static void FfbDownloadEffect(uint8_t id)
+	{
+	TEffectState* effect = &gEffectStates[id];
+
+	uint8_t hdr_len;
+	const uint8_t*	hdr = ffb->GetSysExHeader(&hdr_len); // header includes the first 0xF0
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, hdr, hdr_len);
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, effect->data, effect->length);
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, effect->sysexEnd, sizeof(effect->sysexEnd));
+	FfbMidiCommit(MIDI_QUEUE_BULK, id);
+
+	effect->dirty = 0;	// all included in the download
+	SetEffectState(id, MEffectState_SentToJoystick);
+	}
+
+void FfbDownloadAllEffects(void)
+	{
+	// With the Pro each effect is placed at its own index, so the freed indexes
+	// between them do not matter. The wheel gives the lowest free index to each
+	// new effect, so sending the effects in index order gets them the same
+	// indexes there as long as there are no gaps.
+	for (TEffectMask set = gSentEffects; set; set &= set - 1)
+		{
+		uint8_t id = EffectMaskFirst(set);
+		TEffectState* effect = &gEffectStates[id];
+
+		FfbSendEffect(id);
+		if ((effect->state & MEffectState_Playing) && !FfbEffectDisabled(id))
+			ffb->StartEffect(id);
+		}
+	}
+
 uint16_t UsbUint16ToMidiUint14_Time(uint16_t inUsbValue)
 	{ //Only use for Time conversion from ms. Includes /2 as MIDI duration is in units of 2ms
 	if (inUsbValue == 0xFFFF)
@@ -229,7 +886,7 @@ uint8_t CalcGain(uint8_t usbValue, uint8_t gain)
 	}
 
 // Lengths of each report type
-const uint16_t OutReportSize[] = {
+const uint16_t OutReportSize[FFB_OUTPUT_REPORTS] = {
 	sizeof(USB_FFBReport_SetEffect_Output_Data_t),		// 1
 	sizeof(USB_FFBReport_SetEnvelope_Output_Data_t),	// 2
 	sizeof(USB_FFBReport_SetCondition_Output_Data_t),	// 3
@@ -244,6 +901,9 @@ const uint16_t OutReportSize[] = {
 	sizeof(USB_FFBReport_DeviceControl_Output_Data_t),	// 12
 	sizeof(USB_FFBReport_DeviceGain_Output_Data_t),	// 13
 	sizeof(USB_FFBReport_SetCustomForce_Output_Data_t),	// 14
+	sizeof(USB_FFBReport_DirectForce_Output_Data_t),	// 15
+	sizeof(USB_FFBReport_BatchUpdate_Output_Data_t),	// 16
+	sizeof(USB_FFBReport_GroupOperation_Output_Data_t),	// 17
 	};
 
 void FfbHandle_EffectOperation(USB_FFBReport_EffectOperation_Output_Data_t *data);
@@ -254,6 +914,9 @@ void FfbHandle_SetCustomForceData(USB_FFBReport_SetCustomForceData_Output_Data_t
 void FfbHandle_SetDownloadForceSample(USB_FFBReport_SetDownloadForceSample_Output_Data_t* data);
 void FfbHandle_SetCustomForce(USB_FFBReport_SetCustomForce_Output_Data_t* data);
 void FfbHandle_SetEffect(USB_FFBReport_SetEffect_Output_Data_t *data);
+void FfbHandle_DirectForce(USB_FFBReport_DirectForce_Output_Data_t *data);
+void FfbHandle_BatchUpdate(USB_FFBReport_BatchUpdate_Output_Data_t *data);
+void FfbHandle_GroupOperation(USB_FFBReport_GroupOperation_Output_Data_t *data);
 
 // Handle incoming data from USB and convert it to MIDI data to joystick
 void FfbOnUsbData(uint8_t *data, uint16_t len)
@@ -264,6 +927,15 @@ void FfbOnUsbData(uint8_t *data, uint16_t len)
 	LogReport(PSTR("Usb  =>"), OutReportSize, data, len);
 
 	uint8_t effectId = data[1]; // effectBlockIndex is always the second byte.
+
+	if ((data[0] <= 6 && (effectId == 0 || effectId > MAX_EFFECTS || !(gAllocatedEffects & EffectBit(effectId)))) ||
+		((data[0] <= 6 || data[0] == 10 || data[0] == 11) && effectId == DIRECT_FORCE_ID))
+		{
+		// Effect parameter report for an effect that is not allocated and has no data,
+		// or any report on the direct force effect, which the host has not allocated
+		LEDs_SetAllLEDs(LEDS_NO_LEDS);
+		return;
+		}
 		
 	switch (data[0])	// reportID
 		{
@@ -308,6 +980,15 @@ void FfbOnUsbData(uint8_t *data, uint16_t len)
 		case 14:
 			FfbHandle_SetCustomForce((USB_FFBReport_SetCustomForce_Output_Data_t*) data);
 			break;
+		case 15:
+			FfbHandle_DirectForce((USB_FFBReport_DirectForce_Output_Data_t*) data);
+			break;
+		case 16:
+			FfbHandle_BatchUpdate((USB_FFBReport_BatchUpdate_Output_Data_t*) data);
+			break;
+		case 17:
+			FfbHandle_GroupOperation((USB_FFBReport_GroupOperation_Output_Data_t*) data);
+			break;
 		default:
 			break;
 		};
@@ -315,54 +996,306 @@ void FfbOnUsbData(uint8_t *data, uint16_t len)
 	LEDs_SetAllLEDs(LEDS_NO_LEDS);
 	}
 
-void FfbOnCreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData, USB_FFBReport_PIDBlockLoad_Feature_Data_t *outData)
+// Output report queue.
+//
+// The FFB endpoint interrupt only stores the received reports here, so that
+// the joystick input and control endpoints are not left waiting while the
+// reports are translated to MIDI. FfbProcessReports() then handles a few of
+// them per main loop pass. While the queue is full, the next OUT packet is
+// left in the endpoint and the host simply retries it later.
+//
+// The reports are kept back to back in a ring of bytes. The length of each
+// comes from its reportId (OutReportSize), so the queue holds many of the
+// short reports but reserves no room for the long Batch Update in each slot.
+#define FFB_REPORTS_PER_PASS	4
+
+#define REPORT_QUEUE_MASK	(FFB_REPORT_QUEUE_SIZE - 1)
+
+static uint8_t gReportQueue[FFB_REPORT_QUEUE_SIZE];
+static volatile uint8_t gReportQueueHead = 0;	// first byte of the next report to handle
+static volatile uint8_t gReportQueueUsed = 0;	// bytes
+
+TReportQueueStats gReportStats;
+
+// Byte <offset> of the queued report starting at <pos>
+#define QueuedByte(pos, offset)	gReportQueue[((pos) + (offset)) & REPORT_QUEUE_MASK]
+
+// Length of the queued report starting at <pos>
+#define QueuedSize(pos)	OutReportSize[QueuedByte(pos, 0) - 1]
+
+// Returns 1 if the <newer> report overwrites all that the one queued at <pos>
+// sets. Parameter reports are matched by effect block and, for conditions, by
+// the parameter block (axis). Device gain and direct force replace any older
+// report of the same kind.
+static uint8_t FfbReportSupersedes(const uint8_t *newer, uint8_t pos)
+	{
+	if (newer[0] != QueuedByte(pos, 0))
+		return 0;
+
+	switch (newer[0])	// reportID
+		{
+		case 1:
+		case 2:
+		case 4:
+		case 5:
+		case 6:
+			return newer[1] == QueuedByte(pos, 1);
+		case 3:
+			return newer[1] == QueuedByte(pos, 1) && newer[2] == QueuedByte(pos, 2);
+		case 13:
+		case 15:
+			return 1;
+		default:
+			return 0;
+		};
+	}
+
+// Returns 1 for reports whose order relative to the other reports matters:
+// Effect Operation, Block Free, Device Control, Batch Update and Group
+// Operation. A Batch Update carries several reports, so a later report must
+// not be merged past it into an older one that the batch overrides.
+static uint8_t FfbReportIsBarrier(uint8_t reportId)
+	{
+	return (reportId >= 10 && reportId <= 12) || reportId == 16 || reportId == 17;
+	}
+
+// Copy <len> bytes of <data> to the queue starting at <pos>
+static void FfbReportQueueWrite(uint8_t pos, const uint8_t *data, uint8_t len)
+	{
+	while (len--)
+		gReportQueue[pos++ & REPORT_QUEUE_MASK] = *data++;
+	}
+
+uint8_t FfbQueueUsbData(const uint8_t *data, uint8_t len)
+	{
+	if (len > FFB_REPORT_MAX_SIZE)
+		{
+		gReportStats.dropped++;
+		return 0;
+		}
+
+	// Only the FFB endpoint interrupt adds reports, and the main loop cannot
+	// take one out meanwhile. A control request may look at the queued
+	// reportIds (see FfbAllocationPending()): a replaced report keeps its
+	// reportId and a new one counts as queued only once it has been stored.
+
+	// Latest value wins: replace the newest queued report with the same
+	// parameters that has no report after it that must keep its order.
+	if (!FfbReportIsBarrier(data[0]))
+		{
+		uint8_t found = 0, match = 0;
+		uint8_t pos = gReportQueueHead;
+		for (uint8_t left = gReportQueueUsed; left; )
+			{
+			uint8_t size = QueuedSize(pos);
+
+			if (FfbReportIsBarrier(QueuedByte(pos, 0)))
+				found = 0;
+			else if (FfbReportSupersedes(data, pos))
+				{
+				found = 1;
+				match = pos;
+				}
+
+			pos += size;
+			left -= size;
+			}
+
+		if (found)
+			{
+			FfbReportQueueWrite(match, data, len);
+			gReportStats.merged++;
+			return 1;
+			}
+		}
+
+	if (len > FFB_REPORT_QUEUE_SIZE - gReportQueueUsed)
+		{
+		gReportStats.dropped++;
+		return 0;
+		}
+
+	FfbReportQueueWrite(gReportQueueHead + gReportQueueUsed, data, len);
+
+	gReportQueueUsed += len;
+	gReportStats.received++;
+	if (gReportQueueUsed > gReportStats.maxUsed)
+		gReportStats.maxUsed = gReportQueueUsed;
+
+	return 1;
+	}
+
+uint8_t FfbReportQueueUsed(void)
+	{
+	return gReportQueueUsed;
+	}
+
+uint8_t FfbReportQueueHasRoom(void)
+	{
+	return FFB_REPORT_QUEUE_SIZE - gReportQueueUsed >= FFB_REPORT_MAX_SIZE;
+	}
+
+uint8_t FfbAllocationPending(void)
+	{
+	CRITICAL_VAR();
+	ENTER_CRITICAL();
+	uint8_t pos = gReportQueueHead;
+	for (uint8_t left = gReportQueueUsed; left; )
+		{
+		uint8_t reportId = QueuedByte(pos, 0);
+		if (reportId == 11 || reportId == 12)
+			EXIT_CRITICAL_RET(1);
+
+		uint8_t size = QueuedSize(pos);
+		pos += size;
+		left -= size;
+		}
+	EXIT_CRITICAL_RET(0);
+	}
+
+void FfbProcessReports(void)
+	{
+	uint8_t budget = FFB_REPORTS_PER_PASS;
+
+	while (gReportQueueUsed)
+		{
+		// Leave the rest for later passes rather than wait for room in the MIDI buffers
+		if (budget == 0 || FfbMidiBufferUsed() >= MIDI_BACKLOG_HIGH_WATER ||
+				!FfbMidiRoom(MIDI_QUEUE_HIGH, MIDI_REPORT_HIGH_ROOM, MIDI_REPORT_HIGH_ROOM / MIDI_OPERATION_SIZE))
+			{
+			gReportStats.deferredPasses++;
+			return;
+			}
+
+		// Take a copy, since a newer report may replace the queued one meanwhile
+		uint8_t report[FFB_REPORT_MAX_SIZE];
+
+		CRITICAL_VAR();
+		ENTER_CRITICAL();
+		uint8_t pos = gReportQueueHead;
+		uint8_t size = QueuedSize(pos);
+		for (uint8_t i = 0; i < size; i++)
+			report[i] = QueuedByte(pos, i);
+		gReportQueueHead = (pos + size) & REPORT_QUEUE_MASK;
+		gReportQueueUsed -= size;
+		EXIT_CRITICAL();
+
+		FfbOnUsbData(report, size);
+		budget--;
+
+		// The detailed traces of a report fill much of the debug buffer
+		if (DoDebug(DEBUG_DETAIL))
+			FlushDebugBuffer();
+		}
+	}
+
+// Result of the latest Create New Effect request, returned by the following
+// PID Block Load GetReport request.
+static USB_FFBReport_PIDBlockLoad_Feature_Data_t gBlockLoad =
+	{
+	.reportId = 6,
+	.effectBlockIndex = 0,
+	.loadStatus = 3,	// 1=Success,2=Full,3=Error
+	.ramPoolAvailable = 0xFFFF,
+	};
+
+// Effect creation rate is measured over bursts of Create New Effect requests
+// that come less than this many USB frames (ms) apart.
+#define CREATE_BURST_GAP	100
+
+static uint16_t gLastCreateFrame = 0;
+
+// Allocate an effect with default parameters.
+// Returns the effect block index or 0 if all are in use.
+static uint8_t CreateEffect(TEffectMask from, USB_FFBReport_CreateNewEffect_Feature_Data_t* inData)
+	{
+	uint8_t id = GetNextFreeEffect(from, ffb->EffectDataLength(inData->effectType));
+	if (id == 0)
+		return 0;
+
+	TEffectState* effect = &gEffectStates[id];
+	
+	effect->usb_duration = USB_DURATION_INFINITE;
+	effect->usb_fadeTime = USB_DURATION_INFINITE;
+	effect->usb_gain = 0xFF;
+	effect->usb_offset = 0;
+	effect->usb_attackLevel = 0xFF;
+	effect->usb_fadeLevel = 0xFF;
+
+	((midi_data_common_t*)effect->data)->waveForm = ffb->UsbToMidiEffectType(inData->effectType - 1);
+	
+	ffb->CreateNewEffect(inData, effect);
+
+	return id;
+	}
+
+static uint8_t SetDirectForce(int8_t x, int8_t y);
+
+void FfbOnCreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData)
 {
+	USB_FFBReport_PIDBlockLoad_Feature_Data_t *outData = &gBlockLoad;
+
+	// Reports sent before this request (e.g. block free or reset) have taken
+	// effect already: the request waits until FfbAllocationPending() is clear.
 	outData->reportId = 6;
-	outData->effectBlockIndex = GetNextFreeEffect();
+
+	// The wheel gives each downloaded effect the lowest free index, so the
+	// direct force index must be taken before the host's effects
+	if (!ffb->SetDownloadIndex)
+		SetDirectForce(0, 0);
+
+	outData->effectBlockIndex = CreateEffect(EFFECTS_ALLOCATABLE, inData);
 	
 	if (outData->effectBlockIndex == 0) {
 		outData->loadStatus = 2;	// 1=Success,2=Full,3=Error
 	} else {
 		outData->loadStatus = 1;	// 1=Success,2=Full,3=Error
-		
-		volatile TEffectState* effect = &gEffectStates[outData->effectBlockIndex];
-		
-		effect->usb_duration = USB_DURATION_INFINITE;
-		effect->usb_fadeTime = USB_DURATION_INFINITE;
-		effect->usb_gain = 0xFF;
-		effect->usb_offset = 0;
-		effect->usb_attackLevel = 0xFF;
-		effect->usb_fadeLevel = 0xFF;
-
-		((midi_data_common_t*)effect->data)->waveForm = ffb->UsbToMidiEffectType(inData->effectType - 1);
-		
-		ffb->CreateNewEffect(inData, effect);
 	}
 	
 	outData->ramPoolAvailable = 0xFFFF;	// =0 or 0xFFFF - don't really know what this is used for?
 
+	// USB frame numbers are 11 bits i.e. wrap around every 2048 ms
+	uint16_t frame = USB_Device_GetFrameNumber();
+	uint16_t sinceLast = (frame - gLastCreateFrame) & 0x7FF;
+	gLastCreateFrame = frame;
+
+	gReportStats.effectsCreated++;
+	if (gReportStats.createBurst == 0 || sinceLast > CREATE_BURST_GAP)
+		{
+		gReportStats.createBurst = 1;
+		gReportStats.createBurstTime = 0;
+		}
+	else
+		{
+		gReportStats.createBurst++;
+		gReportStats.createBurstTime += sinceLast;
+		}
+
 	if (DoDebug(DEBUG_DETAIL))
 		{
 		LogTextP(PSTR("Create New Effect => id="));
 		LogBinary(&outData->effectBlockIndex, 1);
 		LogTextP(PSTR(", status="));
 		LogBinaryLf(&outData->loadStatus, 1);
-		FlushDebugBuffer();
 		}
+}
 
-	LogDataLf("Usb <=", outData->reportId, outData, sizeof(USB_FFBReport_PIDBlockLoad_Feature_Data_t));
+void FfbOnPIDBlockLoad(USB_FFBReport_PIDBlockLoad_Feature_Data_t *data)
+	{
+	*data = gBlockLoad;
 
-	WaitMs(5);
-}
+	LogDataLf("Usb <=", data->reportId, data, sizeof(USB_FFBReport_PIDBlockLoad_Feature_Data_t));
+	}
 
 void FfbHandle_SetEffect(USB_FFBReport_SetEffect_Output_Data_t *data)
 {
-	volatile TEffectState* effect = &gEffectStates[data->effectBlockIndex];
+	TEffectState* effect = &gEffectStates[data->effectBlockIndex];
 	
 	if (DoDebug(DEBUG_DETAIL))
 		{
 		LogTextP(PSTR("Set Effect:"));
 		LogBinaryLf(data, sizeof(USB_FFBReport_SetEffect_Output_Data_t));
+		FlushDebugBuffer();	// the rest would not fit in the debug buffer with this
 		LogTextP(PSTR("  id  =")); LogBinaryLf(&data->effectBlockIndex, sizeof(data->effectBlockIndex));
 		LogTextP(PSTR("  type=")); LogBinaryLf(&data->effectType, sizeof(data->effectType));
 		LogTextP(PSTR("  gain=")); LogBinaryLf(&data->gain, sizeof(data->gain));
@@ -385,26 +1318,257 @@ void FfbHandle_SetEffect(USB_FFBReport_SetEffect_Output_Data_t *data)
 
 	midi_data_common_t* midi_data = (midi_data_common_t*)effect->data;
 	
+	uint16_t duration;
 	if (data->duration == USB_DURATION_INFINITE) {
-		midi_data->duration = MIDI_DURATION_INFINITE;
+		duration = MIDI_DURATION_INFINITE;
 	} else {
-		midi_data->duration = UsbUint16ToMidiUint14_Time(data->duration); // MIDI unit is 2ms
+		duration = UsbUint16ToMidiUint14_Time(data->duration); // MIDI unit is 2ms
 	}
 	effect->usb_duration = data->duration;	// store for later calculation of <fadeTime>
 
+	// Driver updates the effect data and sends the change if needed
 	if (effect->state & MEffectState_SentToJoystick)
-		ffb->ModifyDuration(data->effectBlockIndex, midi_data->duration);
+		ffb->ModifyDuration(data->effectBlockIndex, effect, duration);
+	else
+		midi_data->duration = duration;
 
 	uint8_t midi_data_len = ffb->SetEffect((USB_FFBReport_SetEffect_Output_Data_t *) data, effect);
 	
-	// Send full effect data to MIDI if this effect has not been sent yet
-	if (!(effect->state & MEffectState_SentToJoystick)) {
-		FfbSendSysEx((const uint8_t*)effect->data, midi_data_len);
-		effect->state |= MEffectState_SentToJoystick;
-	}
+	// The effect is sent to joystick in the background by FfbService() or
+	// at the latest when it is started
+	if (!(effect->state & MEffectState_SentToJoystick) && midi_data_len <= FfbEffectDataSize(effect))
+		FfbFrameEffect(effect, midi_data_len);
 
 }
 
+// Direct force.
+//
+// The host gives just the force vector of each moment, e.g. once per game
+// frame. It is played with a single constant force effect that is kept in
+// the joystick at DIRECT_FORCE_ID, outside the host's pool, so that the
+// host's stops do not touch it. It is created on the first report or, with
+// the wheel, before the host's first effect. The vector is fed
+// through the regular Set Effect and Set Constant Force handling, so only
+// the direction and magnitude values that actually change are sent, and
+// under load only their newest values (see FfbService()).
+
+// Degrees of atan(a/b) for 0 <= a <= b, b > 0
+static uint8_t Atan01(uint8_t a, uint8_t b)
+	{
+	uint16_t z = ((uint16_t) a << 8) / b;	// 0..256 for 0..1
+
+	// atan(z) ~ 45z + 15.64z(1-z) degrees, error below 0.3 degrees
+	return (uint8_t) ((45 * z + (uint16_t) ((4004ul * z * (256 - z)) >> 16) + 128) >> 8);
+	}
+
+// Direction of the force vector in degrees (0..359): 0 = -Y, 90 = +X like DirectInput polar coordinates
+static uint16_t ForceDirection(int8_t x, int8_t y)
+	{
+	int8_t east = x, north = -y;
+	uint8_t ae = (east < 0) ? -east : east;
+	uint8_t an = (north < 0) ? -north : north;
+
+	if (ae == 0 && an == 0)
+		return 0;
+
+	// Angle from the Y axis within the quadrant, 0..90
+	uint16_t a = (ae <= an) ? Atan01(ae, an) : 90 - Atan01(an, ae);
+
+	if (east >= 0)
+		return (north >= 0) ? a : 180 - a;
+	else
+		return (north < 0) ? 180 + a : (360 - a) % 360;
+	}
+
+// Length of the force vector
+static uint8_t ForceLength(int8_t x, int8_t y)
+	{
+	uint16_t sq = (uint16_t) (x * x) + (uint16_t) (y * y);
+	uint16_t root = 0;
+
+	for (uint16_t bit = 1 << 14; bit; bit >>= 2)
+		{
+		if (sq >= root + bit)
+			{
+			sq -= root + bit;
+			root = (root >> 1) + bit;
+			}
+		else
+			root >>= 1;
+		}
+
+	return (uint8_t) root;
+	}
+
+// Set the force of the direct force effect, creating the effect first if needed.
+// Returns 0 if there is no room for it.
+static uint8_t SetDirectForce(int8_t x, int8_t y)
+	{
+	uint8_t id = DIRECT_FORCE_ID;
+	if (!(gAllocatedEffects & EffectBit(id)))
+		{
+		USB_FFBReport_CreateNewEffect_Feature_Data_t create =
+			{ .reportId = 5, .effectType = USB_EFFECT_CONSTANT, .byteCount = 0 };
+		if (CreateEffect(EffectBit(id), &create) == 0)
+			return 0;	// no room for its MIDI data
+		}
+
+	uint8_t length = ForceLength(x, y);
+	if (length > 127)
+		length = 127;
+
+	USB_FFBReport_SetEffect_Output_Data_t effect =
+		{
+		.reportId = 1,
+		.effectBlockIndex = id,
+		.effectType = USB_EFFECT_CONSTANT,
+		.duration = USB_DURATION_INFINITE,
+		.gain = 0xFF,
+		.enableAxis = 0x04,	// direction enable
+		.directionX = ForceDirection(x, y) / 2,	// 2 degree units
+		};
+	FfbHandle_SetEffect(&effect);
+
+	USB_FFBReport_SetConstantForce_Output_Data_t force =
+		{ .reportId = 5, .effectBlockIndex = id, .magnitude = 2 * length };
+	ffb->SetConstantForce(&force, &gEffectStates[id]);
+	return id;
+	}
+
+void FfbHandle_DirectForce(USB_FFBReport_DirectForce_Output_Data_t *data)
+	{
+	int8_t x = (data->x < -127) ? -127 : data->x;
+	int8_t y = (data->y < -127) ? -127 : data->y;
+
+	uint8_t id = SetDirectForce(x, y);
+	if (id == 0)
+		return;
+
+	if (!(gEffectStates[id].state & MEffectState_Playing))
+		{
+		USB_FFBReport_EffectOperation_Output_Data_t start =
+			{ .reportId = 10, .effectBlockIndex = id, .operation = 1, .loopCount = 1 };
+		FfbHandle_EffectOperation(&start);
+		}
+	}
+
+// Returns the size of the parameter report at <pos> of the batch data or 0
+// if there are no more (complete) reports.
+static uint8_t BatchReportSize(USB_FFBReport_BatchUpdate_Output_Data_t *data, uint8_t pos)
+	{
+	if (pos >= FFB_BATCH_DATA_SIZE)
+		return 0;
+
+	uint8_t reportId = data->data[pos];
+	if (reportId < 1 || reportId > 6)
+		return 0;
+
+	uint8_t size = OutReportSize[reportId-1];
+	if (pos + size > FFB_BATCH_DATA_SIZE)
+		return 0;
+
+	return size;
+	}
+
+// Applies all the parameter reports of the batch and then sends the resulting
+// modifications together, so that they go out as one run of MIDI messages
+// sharing the running status.
+void FfbHandle_BatchUpdate(USB_FFBReport_BatchUpdate_Output_Data_t *data)
+	{
+	uint8_t pos, size;
+
+	for (pos = 0; (size = BatchReportSize(data, pos)) != 0; pos += size)
+		FfbOnUsbData(&data->data[pos], size);
+
+	if (gThrottled)
+		return;	// FfbService() sends them once the backlog has drained
+
+	// Send the changes of each effect once, while there is room for them.
+	// FfbService() sends the rest later.
+	TEffectMask touched = 0;
+	for (pos = 0; (size = BatchReportSize(data, pos)) != 0; pos += size)
+		{
+		uint8_t id = data->data[pos+1];
+		if (id >= 1 && id <= MAX_EFFECTS)
+			touched |= EffectBit(id);
+		}
+
+	for (touched &= gSentEffects; touched; touched &= touched - 1)
+		{
+		uint8_t id = EffectMaskFirst(touched);
+		uint8_t modifies = EffectModifies(id);
+		if (!FfbMidiRoom(MIDI_QUEUE_BULK, modifies * MIDI_MODIFY_SIZE, modifies))
+			return;
+		FlushEffect(id);
+		}
+	}
+
+// Returns the effects selected by the bits of a Group Operation report
+static TEffectMask EffectSetToMask(const uint8_t *effects)
+	{
+	TEffectMask set = 0;
+	for (uint8_t i = sizeof(((USB_FFBReport_GroupOperation_Output_Data_t*) 0)->effects); i > 0; i--)
+		set = (set << 8) | effects[i-1];
+	return set & EFFECTS_ALL;
+	}
+
+// Stops the playing effects of the set. When that covers all the host's playing
+// effects, they are stopped with a single "stop all".
+static void StopEffectSet(TEffectMask set)
+	{
+	TEffectMask playing = gPlayingEffects & EFFECTS_ALLOCATABLE;
+	TEffectMask stopping = playing & set;
+
+	if (stopping == 0)
+		return;
+
+	if (stopping == playing)
+		{
+		StopAllEffects();
+		return;
+		}
+
+	for (; stopping; stopping &= stopping - 1)
+		StopEffect(EffectMaskFirst(stopping));
+	}
+
+void FfbHandle_GroupOperation(USB_FFBReport_GroupOperation_Output_Data_t *data)
+	{
+	if (DoDebug(DEBUG_DETAIL))
+		{
+		LogTextP(PSTR("Group Operation:"));
+		LogBinaryLf(&data->operation, sizeof(data->operation));
+		}
+
+	TEffectMask set = EffectSetToMask(data->effects) & gAllocatedEffects & EFFECTS_ALLOCATABLE;
+
+	if (data->operation == 3)
+		{	// Stop
+		StopEffectSet(set);
+		return;
+		}
+
+	if (data->operation == 2)
+		StopEffectSet(~set);	// StartSolo: stop the others first
+	else if (data->operation != 1)
+		return;
+
+	// Download and update all the effects first, so that the start commands
+	// follow each other without other messages in between. Those that cannot
+	// be downloaded yet are started later by FfbService().
+	TEffectMask ready = 0;
+	for (TEffectMask left = set; left; left &= left - 1)
+		{
+		uint8_t id = EffectMaskFirst(left);
+		StartEffect(id, 1);
+		if (PrepareStart(id))
+			ready |= EffectBit(id);
+		}
+
+	for (; ready; ready &= ready - 1)
+		SendStart(EffectMaskFirst(ready));
+	}
+
 void FfbOnPIDPool(USB_FFBReport_PIDPool_Feature_Data_t *data)
 	{
 	if (DoDebug(DEBUG_DETAIL))
@@ -423,7 +1587,7 @@ void FfbOnPIDPool(USB_FFBReport_PIDPool_Feature_Data_t *data)
 void FfbHandle_SetCustomForceData(USB_FFBReport_SetCustomForceData_Output_Data_t *data)
 	{
 	if (DoDebug(DEBUG_DETAIL))
-		LogTextLf("Set Custom Force Data");
+		LogTextLfP(PSTR("Set Custom Force Data"));
 	}
 
 
@@ -431,7 +1595,7 @@ void FfbHandle_SetCustomForceData(USB_FFBReport_SetCustomForceData_Output_Data_t
 void FfbHandle_SetDownloadForceSample(USB_FFBReport_SetDownloadForceSample_Output_Data_t *data)
 	{
 	if (DoDebug(DEBUG_DETAIL))
-		LogTextLf("Set Download Force Sample");
+		LogTextLfP(PSTR("Set Download Force Sample"));
 	}
 
 
@@ -454,32 +1618,37 @@ void FfbHandle_EffectOperation(USB_FFBReport_EffectOperation_Output_Data_t *data
 		if (DoDebug(DEBUG_DETAIL))
 			LogTextLfP(PSTR(" Start"));
 
-		StartEffect(data->effectBlockIndex);
-		if (!gDisabledEffects.effectId[eid])
-			ffb->StartEffect(eid);
+		// Effect must start with its latest parameters
+		if (eid == 0x7F)
+			PlayAllEffects(data->loopCount);
+		else
+			PlayEffect(eid, data->loopCount);
 		}
 	else if (data->operation == 2)
 		{	// StartSolo
 		if (DoDebug(DEBUG_DETAIL))
 			LogTextLfP(PSTR(" StartSolo"));
 
-		// Stop all first
+		// Stop the others first. The given effect is restarted anyway.
+		if (eid >= 1 && eid <= MAX_EFFECTS)
+			ClearEffectState(eid, MEffectState_Playing);
 		StopAllEffects();
-		if (!gDisabledEffects.effectId[eid])
-			ffb->StopEffect(0x7F); // TODO: wheel ?
-
-		// Then start the given effect
-		StartEffect(data->effectBlockIndex);
 
-		if (!gDisabledEffects.effectId[eid])
-			ffb->StartEffect(0x7F);	// TODO: wheel ?
+		// Then start only the given effect
+		if (eid == 0x7F)
+			PlayAllEffects(data->loopCount);
+		else
+			PlayEffect(eid, data->loopCount);
 		}
 	else if (data->operation == 3)
 		{	// Stop
 		if (DoDebug(DEBUG_DETAIL))
 			LogTextLfP(PSTR(" Stop"));
 
-		StopEffect(data->effectBlockIndex);
+		if (eid == 0x7F)
+			StopAllEffects();
+		else
+			StopEffect(eid);
 		}
 	else
 		{
@@ -525,47 +1694,45 @@ void FfbHandle_DeviceControl(USB_FFBReport_DeviceControl_Output_Data_t *data)
 //	uint8_t	status;	// Bits: 0=Device Paused,1=Actuators Enabled,2=Safety Switch,3=Actuator Override Switch,4=Actuator Power
 //	uint8_t	effectBlockIndex;	// Bit7=Effect Playing, Bit0..7=EffectId (1..40)
 
-	pidState.reportId = 2;
-	pidState.status |= 1 << 2;
-	pidState.status |= 1 << 4;
-	pidState.effectBlockIndex = 0;
-
 	if (control == 0x01)
 		{
-		LogTextLf("Disable Actuators");
-		pidState.status = (pidState.status & 0xFE);
+		LogTextLfP(PSTR("Enable Actuators"));
+		pidState.status |= PID_STATUS_ACTUATORS_ENABLED;
 		}
 	else if (control == 0x02)
 		{
-		LogTextLf("Enable Actuators");
-		pidState.status |= 1 << 2;
+		LogTextLfP(PSTR("Disable Actuators"));
+		pidState.status &= ~PID_STATUS_ACTUATORS_ENABLED;
 		}
 	else if (control == 0x03)
 		{
 		// Stop all effects (e.g. FFB-application to foreground)
-		LogTextLf("Stop All Effects");
+		LogTextLfP(PSTR("Stop All Effects"));
 
 		// Disable auto-center spring and stop all effects
 //	???? The below would take too long?
 		ffb->SetAutoCenter(0);
-		pidState.effectBlockIndex = 0;
+		StopAllEffects();
 		}
 	else if (control == 0x04)
 		{
-		LogTextLf("Reset");
+		LogTextLfP(PSTR("Reset"));
 		// Reset (e.g. FFB-application out of focus)
 		// Enable auto-center spring and stop all effects
 		ffb->SetAutoCenter(1);
 		WaitMs(75);
 		FreeAllEffects();
+		pidState.status &= ~PID_STATUS_PAUSED;
 		}
 	else if (control == 0x05)
 		{
-		LogTextLf("Pause");
+		LogTextLfP(PSTR("Pause"));
+		pidState.status |= PID_STATUS_PAUSED;
 		}
 	else if (control == 0x06)
 		{
-		LogTextLf("Continue");
+		LogTextLfP(PSTR("Continue"));
+		pidState.status &= ~PID_STATUS_PAUSED;
 		}
 	else if (control  & (0xFF-0x3F))
 		{
@@ -590,7 +1757,7 @@ FfbHandle_DeviceGain(USB_FFBReport_DeviceGain_Output_Data_t *data)
 void
 FfbHandle_SetCustomForce(USB_FFBReport_SetCustomForce_Output_Data_t *data)
 	{
-	LogTextLf("Set Custom Force");
+	LogTextLfP(PSTR("Set Custom Force"));
 //	LogBinary(&data, sizeof(USB_FFBReport_SetCustomForce_Output_Data_t));
 	}
 
@@ -634,7 +1801,7 @@ void WaitMs(int ms)
 void FfbInitMidi()
 	{
 	// Initialize some states
-	memset((void*) &gDisabledEffects, 0, sizeof(gDisabledEffects));
+	memset(&gDisabledEffects, 0, sizeof(gDisabledEffects));
 
 	// Check TX-pin (PD3) settings
 	DDRD = DDRD | 0b00001000;
@@ -651,107 +1818,449 @@ void FfbInitMidi()
 
 	UDR1 = 0;	// write something to get things going
 
-	memset((void*) gEffectStates, 0, sizeof(gEffectStates));
-	memset((void*) &pidState, 0, sizeof(pidState));
-	nextEID = 2;
+	memset(gEffectStates, 0, sizeof(gEffectStates));
+	memset(&pidState, 0, sizeof(pidState));
+	pidState.reportId = 2;
+	pidState.status = PID_STATUS_ACTUATORS_ENABLED | PID_STATUS_SAFETY_SWITCH | PID_STATUS_ACTUATOR_POWER;
+	gReportedPlaying = 0;
+	memset((void*) &gMidiStats, 0, sizeof(gMidiStats));
+	FfbMidiResetRunningStatus();
+	FreeAllEffects();
 
 	ffb->EnableInterrupts();
 	}
 
-void FfbSendByte(uint8_t data);
+// ----------------------------------------------
+// Sending MIDI data to joystick
+// ----------------------------------------------
 
-void FfbSendData(const uint8_t *data, uint16_t len)
+// Buffer for sending data to MIDI (must be a power of two and at most 256).
+// It holds the longest effect download and start with room to spare, and the
+// main loop keeps the backlog below MIDI_BACKLOG_HIGH_WATER anyway.
+// Comment out to fall back to sending each byte by busy-waiting on the USART.
+#define MIDI_BUFFER_SIZE 64
+
+volatile TMidiStats gMidiStats;
+
+// ----------------------------------------------
+// MIDI running status
+//
+// Channel messages repeating the status byte of the previous channel message
+// can leave the status byte out (e.g. "B5 40 02 B5 48 02" => "B5 40 02 48 02").
+// The elision is done right before the wire so that whatever is queued stays
+// in plain full messages. System exclusive and system common messages cancel
+// the running status, system real-time messages do not affect it.
+// ----------------------------------------------
+
+static uint8_t gMidiRunningStatusEnabled = 1;
+static volatile uint8_t gMidiRunningStatus = 0;	// last channel status byte sent, 0 if none
+
+// Returns true if the given byte must be transmitted
+static inline uint8_t FfbMidiEncodeByte(uint8_t data)
+	{
+	if (data < 0x80)
+		return 1;	// data byte
+
+	if (data < 0xF0)
+		{	// channel message status byte
+		if (data == gMidiRunningStatus)
+			{
+			gMidiStats.statusElided++;
+			return 0;
+			}
+		if (gMidiRunningStatusEnabled)
+			gMidiRunningStatus = data;
+		}
+	else if (data < 0xF8)
+		gMidiRunningStatus = 0;	// SysEx or system common
+
+	return 1;
+	}
+
+void FfbEnableRunningStatus(uint8_t inEnable)
+	{
+	gMidiRunningStatusEnabled = inEnable;
+	FfbMidiResetRunningStatus();
+	}
+
+void FfbMidiResetRunningStatus(void)
+	{
+	gMidiRunningStatus = 0;
+	}
+
+#ifndef MIDI_BUFFER_SIZE
+
+// Non-buffered MIDI - everything is sent immediately in the order given
+static void FfbMidiQueueBytes(uint8_t queue, const uint8_t *data, uint16_t len)
 	{
 	if (gDebugMode)
 		{
 		LogTextP(PSTR(" => Midi:")); LogBinaryLf(data, len);
 		}
 
-	uint16_t i = 0;
-	for (i = 0; i < len; i++)
-		FfbSendByte(data[i]);
-	}
-	
-void FfbSendPackets(const uint8_t *data, uint16_t len)
-	{
-	uint16_t i = 0;
-	while (i < len)
+	while (len--)
 		{
-		WaitMs(1);
-		uint8_t count = data[i++];
-		while (count--)
-			FfbSendByte(data[i++]);
+		uint8_t byte = *data++;
+		if (!FfbMidiEncodeByte(byte))
+			continue;
+
+		// Wait if a byte is being transmitted
+		while((UCSR1A & (1<<UDRE1)) == 0);
+		// Transmit data
+		UDR1 = byte;
 		}
 	}
 
-// ----------------------------------------------
-// Ring buffer for sending MIDI data to joystick
-// ----------------------------------------------
-
-// Buffer for sending data to MIDI
-//#define MIDI_BUFFER_SIZE 128
+static void FfbMidiCommit(uint8_t queue, uint8_t effectId)
+	{
+	}
 
-#ifndef MIDI_BUFFER_SIZE
+uint8_t FfbMidiBufferUsed(void)
+	{
+	return 0;
+	}
 
-// Non-buffered MIDI
-void FfbSendByte(uint8_t data)
+static uint8_t FfbMidiRoom(uint8_t queue, uint8_t bytes, uint8_t messages)
 	{
-	// Wait if a byte is being transmitted
-	while((UCSR1A & (1<<UDRE1)) == 0);
-	// Transmit data
-	UDR1 = data;
+	return 1;	// sent right away
 	}
 
 #else
 
 // Buffered MIDI
+//
+// Messages are queued in two classes and the USART data register empty
+// interrupt feeds them to the wire. Between messages the interrupt always
+// takes the next high priority message (effect operations, device control)
+// before the next bulk message (effect downloads and modifications), so that
+// e.g. starting an effect does not wait behind a long effect download.
+// A message that has been started is always sent to its end.
+//
+// Bytes appended by FfbMidiQueueBytes() are not seen by the interrupt before
+// FfbMidiCommit() marks the end of the message. A message that does not fit in
+// its buffer as a whole is dropped, since sending it in parts would let high
+// priority messages in between.
+//
+// The queue wait time of each message is measured in transmitted bytes
+// (1 byte = 320us at 31250 baud).
+
+#define MIDI_HIGH_BUFFER_SIZE 32	// must be a power of two
+
+// Committed messages per queue. The rings hold as many messages as the buffers
+// hold modifications (bulk) or effect operations (high priority), so that the
+// bytes rather than the message slots run out first.
+#define MIDI_BULK_MESSAGES	(MIDI_BUFFER_SIZE / MIDI_MODIFY_SIZE + 1)
+#define MIDI_HIGH_MESSAGES	(MIDI_HIGH_BUFFER_SIZE / MIDI_OPERATION_SIZE + 1)
+
+#define MIDI_QUEUE_NONE 0xFF
+
+typedef struct
+	{
+	uint8_t end;	// buffer index after the last byte of the message
+	uint8_t effectId;	// effect the message is about, 0 if none
+	uint16_t stamp;	// <gMidiTxCount> when the message was committed
+	} TMidiMessage;
+
+typedef struct
+	{
+	volatile uint8_t *buffer;
+	uint8_t mask;	// buffer size - 1
+	uint8_t head;	// next free slot, advanced by FfbMidiQueueBytes()
+	uint8_t committed;	// end of the last committed message
+	uint8_t tail;	// next byte to transmit, advanced by the interrupt
+	uint8_t msgHead, msgTail;	// committed messages waiting or being sent
+	uint8_t msgCount;	// size of the <messages> ring
+	volatile TMidiMessage *messages;
+	uint8_t rejected;	// the message being queued is too long and is dropped at commit
+	} TMidiQueue;
+
+static volatile uint8_t gMidiBulkBuffer[MIDI_BUFFER_SIZE];
+static volatile uint8_t gMidiHighBuffer[MIDI_HIGH_BUFFER_SIZE];
+static volatile TMidiMessage gMidiBulkMessages[MIDI_BULK_MESSAGES];
+static volatile TMidiMessage gMidiHighMessages[MIDI_HIGH_MESSAGES];
+
+static volatile TMidiQueue gMidiQueues[2] =
+	{
+		{ .buffer = gMidiBulkBuffer, .mask = MIDI_BUFFER_SIZE - 1,
+		  .msgCount = MIDI_BULK_MESSAGES, .messages = gMidiBulkMessages },
+		{ .buffer = gMidiHighBuffer, .mask = MIDI_HIGH_BUFFER_SIZE - 1,
+		  .msgCount = MIDI_HIGH_MESSAGES, .messages = gMidiHighMessages },
+	};
+
+static volatile uint8_t gMidiCurrentQueue = MIDI_QUEUE_NONE;	// queue whose message is being sent
+static volatile uint16_t gMidiTxCount = 0;	// bytes sent, used as time base for queue wait times
+
+// Number of not yet sent bulk messages for each effect (0 = device). Operations
+// on these effects must not overtake them.
+static volatile uint8_t gMidiBulkPending[MAX_EFFECTS+1];
 
-volatile uint8_t gMidiBuffer[MIDI_BUFFER_SIZE];
-volatile unit8_t *midi_buffer_head = gMidiBuffer;
-volatile unit8_t *midi_buffer_tail = gMidiBuffer;
+// Number of not yet sent operations on all effects (0x7F) in the bulk queue.
+// No operation may overtake them.
+static volatile uint8_t gMidiBulkBroadcasts = 0;
 
-void FfbSendByte(uint8_t data)
+// Counts the bulk message about the given effect as pending (+1) or sent (-1)
+static inline void FfbMidiCountBulk(uint8_t effectId, int8_t change)
 	{
-	cli();
+	if (effectId <= MAX_EFFECTS)
+		gMidiBulkPending[effectId] += change;
+	else if (effectId == 0x7F)
+		gMidiBulkBroadcasts += change;
+	}
+
+// Moves the next byte from the buffers to the USART.
+// Must be called with the data register empty.
+static inline void FfbMidiTransmitNext(void)
+	{
+	for (;;)
+		{
+		uint8_t current = gMidiCurrentQueue;
 
-	*gMidiBufferHead++ = data;
+		if (current == MIDI_QUEUE_NONE)
+			{
+			// Between messages - pick the next one by priority
+			if (gMidiQueues[MIDI_QUEUE_HIGH].msgHead != gMidiQueues[MIDI_QUEUE_HIGH].msgTail)
+				current = MIDI_QUEUE_HIGH;
+			else if (gMidiQueues[MIDI_QUEUE_BULK].msgHead != gMidiQueues[MIDI_QUEUE_BULK].msgTail)
+				current = MIDI_QUEUE_BULK;
+			else
+				{
+				// Nothing to send, disable the data register empty interrupt
+				UCSR1B &= ~(1 << UDRIE1);
+				return;
+				}
+
+			volatile TMidiQueue *q = &gMidiQueues[current];
+			uint16_t wait = gMidiTxCount - q->messages[q->msgTail].stamp;
+			volatile TMidiQueueStats *stats = &gMidiStats.queue[current];
+			stats->messages++;
+			stats->waitTotal += wait;
+			if (wait > stats->waitMax)
+				stats->waitMax = wait;
+
+			gMidiCurrentQueue = current;
+			}
 
-	if (gMidiBufferHead == gMidiBufferTail)
-		{	// Ouch - buffer overflown!
+		volatile TMidiQueue *q = &gMidiQueues[current];
+		volatile TMidiMessage *msg = &q->messages[q->msgTail];
+		uint8_t tail = q->tail;
 
-		return;
+		if (tail == msg->end)
+			{
+			// Message completed
+			if (current == MIDI_QUEUE_BULK)
+				FfbMidiCountBulk(msg->effectId, -1);
+			q->msgTail = (q->msgTail + 1 < q->msgCount) ? q->msgTail + 1 : 0;
+			gMidiCurrentQueue = MIDI_QUEUE_NONE;
+			continue;
+			}
+
+		uint8_t data = q->buffer[tail];
+		q->tail = (tail + 1) & q->mask;
+
+		if (FfbMidiEncodeByte(data))
+			{
+			UDR1 = data;
+			gMidiTxCount++;
+			return;
+			}
 		}
+	}
+
+uint8_t FfbMidiBufferUsed(void)
+	{
+	uint8_t used = 0;
+	for (uint8_t i = 0; i < 2; i++)
+		used += (gMidiQueues[i].head - gMidiQueues[i].tail) & gMidiQueues[i].mask;
+	return used;
+	}
+
+static uint8_t FfbMidiRoom(uint8_t queue, uint8_t bytes, uint8_t messages)
+	{
+	volatile TMidiQueue *q = &gMidiQueues[queue];
+
+	CRITICAL_VAR();
+	ENTER_CRITICAL();
+	uint8_t freeBytes = (q->tail - q->head - 1) & q->mask;
+	uint8_t usedMessages = (q->msgHead >= q->msgTail) ?
+		q->msgHead - q->msgTail : q->msgHead + q->msgCount - q->msgTail;
+	uint8_t freeMessages = q->msgCount - 1 - usedMessages;
+	EXIT_CRITICAL();
 
-	if (gMidiBufferHead - gMidiBuffer >= MIDI_BUFFER_SIZE)
-		gMidiBufferHead = gMidiBuffer;
+	return bytes <= freeBytes && messages <= freeMessages;
+	}
 
-	sei();
+// Lets the transmitter make progress while the caller is waiting for it
+static void FfbMidiWait(void)
+	{
+	if (SREG & (1 << SREG_I))
+		{
+		// Let the interrupt send it
+		UCSR1B |= (1 << UDRIE1);
+		}
+	else
+		{
+		// Interrupts are off (e.g. at start-up from SetupHardware()).
+		// Push the data out by polling so that the timing of the
+		// initialization sequence is kept.
+		while ((UCSR1A & (1 << UDRE1)) == 0);
+		FfbMidiTransmitNext();
+		}
 	}
 
+static void FfbMidiQueueBytes(uint8_t queue, const uint8_t *data, uint16_t len)
+	{
+	volatile TMidiQueue *q = &gMidiQueues[queue];
+
+	if (gDebugMode)
+		{
+		LogTextP(PSTR(" => Midi:")); LogBinaryLf(data, len);
+		}
+
+	if (q->rejected)
+		return;
 
-ISR(USART1_UDRE_vect)
+	if (((q->head - q->committed) & q->mask) + len > q->mask)
+		{
+		// The message would not fit in the buffer even when all else has been sent
+		q->head = q->committed;
+		q->rejected = 1;
+		return;
+		}
+
+	while (len--)
+		{
+		uint8_t head = q->head;
+		uint8_t next = (head + 1) & q->mask;
+
+		if (next == q->tail)
+			{
+			// Buffer is full - wait for the interrupt to make room rather than
+			// dropping bytes from the middle of a MIDI message.
+			gMidiStats.overflows++;
+			while (next == q->tail)
+				FfbMidiWait();
+			}
+
+		q->buffer[head] = *data++;
+		q->head = next;
+		}
+	}
+
+static void FfbMidiCommit(uint8_t queue, uint8_t effectId)
 	{
-	cli();
+	volatile TMidiQueue *q = &gMidiQueues[queue];
+
+	if (q->rejected)
+		{
+		q->rejected = 0;
+		gMidiStats.rejected++;
+		return;
+		}
+
+	if (q->head == q->committed)
+		return;	// empty message
 
-	uint8_t i;
+	uint8_t next = (q->msgHead + 1 < q->msgCount) ? q->msgHead + 1 : 0;
+	if (next == q->msgTail)
+		{
+		gMidiStats.overflows++;
+		while (next == q->msgTail)
+			FfbMidiWait();
+		}
 
-	if (gMidiBufferHead == gMidiBufferTail)
+	volatile TMidiMessage *msg = &q->messages[q->msgHead];
+	msg->end = q->head;
+	msg->effectId = effectId;
+
+	CRITICAL_VAR();
+	ENTER_CRITICAL();
+	msg->stamp = gMidiTxCount;
+	if (queue == MIDI_QUEUE_BULK)
+		FfbMidiCountBulk(effectId, 1);
+	q->committed = q->head;
+	q->msgHead = next;
+	EXIT_CRITICAL();
+
+	uint8_t used = FfbMidiBufferUsed();
+	if (used > gMidiStats.maxUsed)
+		gMidiStats.maxUsed = used;
+
+	if (SREG & (1 << SREG_I))
+		UCSR1B |= (1 << UDRIE1);
+	else
 		{
-		// Buffer is empty, disable transmit interrupt
-		UCSR1B = (1<<TXCIE1) | (1<<TXEN1);
+		// No interrupts - send it all out now
+		while (q->msgHead != q->msgTail || gMidiCurrentQueue != MIDI_QUEUE_NONE)
+			FfbMidiWait();
 		}
-	else 
+	}
+
+// Returns true if an operation on the given effect (0x7F = all) must follow
+// bulk messages that are waiting to be sent
+static uint8_t FfbMidiBulkPending(uint8_t effectId)
+	{
+	if (gMidiBulkBroadcasts)
+		return 1;
+
+	if (effectId <= MAX_EFFECTS)
+		return gMidiBulkPending[effectId];
+
+	// All effects
+	for (uint8_t id = 0; id <= MAX_EFFECTS; id++)
 		{
-		i = gMidiBufferTail + 1;
-		if (i >= MIDI_BUFFER_SIZE) i = 0;
-		UDR1 = gMidiBuffer[i];
-		gMidiBufferTail = i;
+		if (gMidiBulkPending[id])
+			return 1;
 		}
+	return 0;
+	}
 
-	sei();
+ISR(USART1_UDRE_vect)
+	{
+	FfbMidiTransmitNext();
 	}
+
 #endif // MIDI_BUFFER_SIZE
 
+void FfbSendData(const uint8_t *data, uint16_t len)
+	{
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, data, len);
+	FfbMidiCommit(MIDI_QUEUE_BULK, 0);
+	}
+
+void FfbSendEffectData(uint8_t effectId, const uint8_t *data, uint16_t len)
+	{
+	FfbMidiQueueBytes(MIDI_QUEUE_BULK, data, len);
+	FfbMidiCommit(MIDI_QUEUE_BULK, effectId);
+	}
+
+void FfbSendOperation(uint8_t effectId, const uint8_t *data, uint16_t len)
+	{
+	uint8_t queue = MIDI_QUEUE_HIGH;
+
+#ifdef MIDI_BUFFER_SIZE
+	// Keep the order with the effect's own download and modifications and with
+	// the earlier operations that had to wait behind them. Counted as pending for
+	// the effect once in the bulk queue, so that the later operations follow it.
+	if (FfbMidiBulkPending(effectId))
+		queue = MIDI_QUEUE_BULK;
+#endif
+
+	FfbMidiQueueBytes(queue, data, len);
+	FfbMidiCommit(queue, effectId);
+	}
+
+void FfbSendPackets(const uint8_t *data, uint16_t len)
+	{
+	uint16_t i = 0;
+	while (i < len)
+		{
+		WaitMs(1);
+		uint8_t count = data[i++];
+		FfbSendData(&data[i], count);
+		i += count;
+		}
+	}
+
 // ----------------------------------------------
 // Debug and other settings
 // ----------------------------------------------
@@ -784,45 +2293,125 @@ const uint8_t MEffectState_SentToJoystick = 0x04;
 
 uint8_t FfbDebugListEffects(uint8_t *index)
 	{
+	// Only the allocated effects, from the given index on
 	if (*index == 0)
-		*index = 2;
+		*index = 1;
+	if (*index > MAX_EFFECTS)
+		return 0;
 
-//	if (*index >= nextEID)
-	if (*index >= MAX_EFFECTS)
+	uint8_t id = EffectMaskFirst(gAllocatedEffects & ~(EffectBit(*index) - 1));
+	if (id == 0)
 		return 0;
 
-	TEffectState *e = (TEffectState*) &gEffectStates[*index];
+	TEffectState *e = &gEffectStates[id];
 
-	LogBinary(index, 1);
-	if (e->state == MEffectState_Allocated)
-		LogTextP(PSTR(" Allocated"));
-	else if (e->state == MEffectState_Playing)
-		LogTextP(PSTR(" Playing\n"));
-	else if (e->state == MEffectState_SentToJoystick)
+	LogBinary(&id, 1);
+	if (gPlayingEffects & EffectBit(id))
+		LogTextP(PSTR(" Playing"));
+	else if (gSentEffects & EffectBit(id))
 		LogTextP(PSTR(" Sent"));
 	else
-		LogTextP(PSTR(" Free"));
+		LogTextP(PSTR(" Allocated"));
 
-	if (gDisabledEffects.effectId[*index])
+	if (FfbEffectDisabled(id))
 		LogTextP(PSTR(" (Disabled)\n"));
 	else
 		LogTextP(PSTR(" (Enabled)\n"));
 
-	if (e->state)
-		{
-		LogTextP(PSTR("  duration="));
-		LogBinary(&e->usb_duration, 2);
-		LogTextP(PSTR("\n  fadeTime="));
-		LogBinary(&e->usb_fadeTime, 2);
-		LogTextP(PSTR("\n  gain="));
-		LogBinary(&e->usb_gain, 1);
-		}
+	LogTextP(PSTR("  duration="));
+	LogBinary(&e->usb_duration, 2);
+	LogTextP(PSTR("\n  fadeTime="));
+	LogBinary(&e->usb_fadeTime, 2);
+	LogTextP(PSTR("\n  gain="));
+	LogBinary(&e->usb_gain, 1);
 
-	*index = *index + 1;
+	*index = id + 1;
 
 	return 1;
 	}
 
+void FfbDebugListStats(void)
+	{
+	LogTextP(PSTR("Midi buffer used="));
+	uint8_t used = FfbMidiBufferUsed();
+	LogBinary(&used, 1);
+	LogTextP(PSTR("\n  max="));
+	LogBinary((const void*) &gMidiStats.maxUsed, 1);
+	LogTextP(PSTR("\n  overflows="));
+	LogBinary((const void*) &gMidiStats.overflows, 2);
+	LogTextP(PSTR("\n  rejected="));
+	LogBinary((const void*) &gMidiStats.rejected, 2);
+	LogTextP(PSTR("\n  running status elided="));
+	LogBinaryLf((const void*) &gMidiStats.statusElided, 2);
+	FlushDebugBuffer();	// the debug buffer holds a few lines at a time
+	LogTextP(PSTR("  modifies coalesced="));
+	LogBinary((const void*) &gMidiStats.modifiesCoalesced, 2);
+	LogTextP(PSTR("\n  modifies suppressed="));
+	LogBinary((const void*) &gMidiStats.modifiesSuppressed, 2);
+	LogTextP(PSTR("\n  modifies sent="));
+	LogBinary((const void*) &gMidiStats.modifiesSent, 2);
+
+	// Share of parameter changes that were replaced by a newer value before sending
+	uint32_t changes = (uint32_t) gMidiStats.modifiesSent + gMidiStats.modifiesCoalesced;
+	uint8_t decimation = changes ? (uint8_t) ((gMidiStats.modifiesCoalesced * 100ul) / changes) : 0;
+	LogTextP(PSTR("\n  decimation %="));
+	LogBinaryLf(&decimation, 1);
+	FlushDebugBuffer();
+	LogTextP(PSTR("  throttled passes="));
+	LogBinary((const void*) &gMidiStats.throttledPasses, 2);
+	LogTextP(PSTR("\n  starts of downloaded effects="));
+	LogBinary((const void*) &gMidiStats.startsResident, 2);
+	LogTextP(PSTR("\n  starts needing download="));
+	LogBinary((const void*) &gMidiStats.startsDownloaded, 2);
+	LogTextP(PSTR("\n  redownloads="));
+	LogBinaryLf((const void*) &gMidiStats.redownloads, 2);
+	FlushDebugBuffer();
+
+	LogTextP(PSTR("Usb reports queued="));
+	LogBinary(&gReportStats.received, 2);
+	LogTextP(PSTR("\n  queue used="));
+	uint8_t queued = FfbReportQueueUsed();
+	LogBinary(&queued, 1);
+	LogTextP(PSTR("\n  max="));
+	LogBinary(&gReportStats.maxUsed, 1);
+	LogTextP(PSTR("\n  dropped="));
+	LogBinary(&gReportStats.dropped, 2);
+	LogTextP(PSTR("\n  merged="));
+	LogBinary(&gReportStats.merged, 2);
+	LogTextP(PSTR("\n  deferred passes="));
+	LogBinaryLf(&gReportStats.deferredPasses, 2);
+	FlushDebugBuffer();
+
+	// Creation rate over the latest burst of Create New Effect requests
+	uint16_t rate = 0;
+	if (gReportStats.createBurstTime)
+		rate = (uint16_t) (((gReportStats.createBurst - 1) * 1000ul) / gReportStats.createBurstTime);
+	LogTextP(PSTR("Effects created="));
+	LogBinary(&gReportStats.effectsCreated, 2);
+	LogTextP(PSTR("\n  latest burst="));
+	LogBinary(&gReportStats.createBurst, 2);
+	LogTextP(PSTR("\n  burst ms="));
+	LogBinary(&gReportStats.createBurstTime, 2);
+	LogTextP(PSTR("\n  effects/s="));
+	LogBinaryLf(&rate, 2);
+	FlushDebugBuffer();
+
+	for (uint8_t i = 0; i < 2; i++)
+		{
+		volatile TMidiQueueStats *stats = &gMidiStats.queue[i];
+		if (i == 0)
+			LogTextP(PSTR("Bulk messages="));
+		else
+			LogTextP(PSTR("High messages="));
+		LogBinary((const void*) &stats->messages, 2);
+		LogTextP(PSTR("\n  wait max="));
+		LogBinary((const void*) &stats->waitMax, 2);
+		LogTextP(PSTR("\n  wait total="));
+		LogBinaryLf((const void*) &stats->waitTotal, 4);
+		FlushDebugBuffer();
+		}
+	}
+
 
 void FfbEnableSprings(uint8_t inEnable)
 	{
@@ -846,9 +2435,15 @@ void FfbEnableSines(uint8_t inEnable)
 
 void FfbEnableEffectId(uint8_t inId, uint8_t inEnable)
 	{
-	gDisabledEffects.effectId[inId] = !inEnable;
+	if (inId < 1 || inId > MAX_EFFECTS)
+		return;
+
+	if (inEnable)
+		gDisabledEffects.effectId[inId >> 3] &= ~(1 << (inId & 7));
+	else
+		gDisabledEffects.effectId[inId >> 3] |= 1 << (inId & 7);
 
-	if (gEffectStates[inId].state == MEffectState_Playing)
+	if (gPlayingEffects & EffectBit(inId))
 		{
 		LogTextP(PSTR("Stop manual:"));
 		LogBinaryLf(&inId, 1);
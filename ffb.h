@@ -38,8 +38,12 @@
  *  This mirrors the layout described to the host in the HID report descriptor, in Descriptors.c.
  */
 
-// Maximum number of parallel effects in memory
-#define MAX_EFFECTS 20
+// Maximum number of parallel effects in memory. The HID descriptor allows
+// indexes up to 40, but the SRAM only has room for this many with a safe
+// stack margin; the "s" serial command shows the stack headroom. How many
+// of them can be set up at a time depends on the size of their MIDI data,
+// see FFB_DATA_UNITS.
+#define MAX_EFFECTS 24
 	
 // ---- Input
 
@@ -47,9 +51,16 @@ typedef struct
 	{
 	uint8_t	reportId;	// =2
 	uint8_t	status;	// Bits: 0=Device Paused,1=Actuators Enabled,2=Safety Switch,3=Actuator Override Switch,4=Actuator Power
-	uint8_t	effectBlockIndex;	// Bit7=Effect Playing, Bit0..7=EffectId (1..40)
+	uint8_t	effectBlockIndex;	// Bit0=Effect Playing, Bit1..7=EffectId (1..40)
 	} USB_FFBReport_PIDStatus_Input_Data_t;
 
+// Bits of <status> in PID State report
+#define PID_STATUS_PAUSED				0x01
+#define PID_STATUS_ACTUATORS_ENABLED	0x02
+#define PID_STATUS_SAFETY_SWITCH		0x04
+#define PID_STATUS_ACTUATOR_OVERRIDE	0x08
+#define PID_STATUS_ACTUATOR_POWER		0x10
+
 // ---- Output
 
 typedef struct
@@ -165,6 +176,28 @@ typedef struct
 	uint16_t	samplePeriod;	// 0..32767 ms
 	} USB_FFBReport_SetCustomForce_Output_Data_t;
 
+typedef struct
+	{ // FFB: Direct Force Output Report (vendor defined)
+	uint8_t	reportId;	// =15
+	int8_t	x;	// -127..127, direction as in DirectInput cartesian coordinates
+	int8_t	y;	// -127..127
+	} USB_FFBReport_DirectForce_Output_Data_t;
+
+#define FFB_BATCH_DATA_SIZE	24
+
+typedef struct
+	{ // FFB: Batch Update Output Report (vendor defined)
+	uint8_t	reportId;	// =16
+	uint8_t	data[FFB_BATCH_DATA_SIZE];	// Parameter reports 1..6 back to back, ended by reportId 0 or the end of data
+	} USB_FFBReport_BatchUpdate_Output_Data_t;
+
+typedef struct
+	{ // FFB: Group Operation Output Report (vendor defined)
+	uint8_t	reportId;	// =17
+	uint8_t	operation;	// 1=Start, 2=StartSolo, 3=Stop
+	uint8_t	effects[5];	// Bit (n-1)%8 of byte (n-1)/8 selects effect block index n (1..40)
+	} USB_FFBReport_GroupOperation_Output_Data_t;
+
 // ---- Features
 
 typedef struct
@@ -191,7 +224,8 @@ typedef struct
 	} USB_FFBReport_PIDPool_Feature_Data_t;
 
 // Lengths of each report type
-extern const uint16_t OutReportSize[];
+#define FFB_OUTPUT_REPORTS 17	// report ids 1..17
+extern const uint16_t OutReportSize[FFB_OUTPUT_REPORTS];
 
 // Handles Force Feeback data manipulation from USB reports to joystick's MIDI channel
 
@@ -209,8 +243,60 @@ void FfbSendDisable(void);
 // Handle incoming data from USB
 void FfbOnUsbData(uint8_t *data, uint16_t len);
 
+// Queue of received output reports waiting for FfbProcessReports().
+// Decouples the USB reception from the slower translation to MIDI.
+// The reports are stored back to back, each taking only its own length.
+#define FFB_REPORT_QUEUE_SIZE	64	// bytes, must be a power of two
+#define FFB_REPORT_MAX_SIZE	sizeof(USB_FFBReport_BatchUpdate_Output_Data_t)
+
+// Store a complete output report for later handling. A queued report that
+// sets the same parameters is replaced by the new one instead.
+// Returns 0 if the queue was full and the report was dropped.
+// Called from the FFB endpoint interrupt.
+uint8_t FfbQueueUsbData(const uint8_t *data, uint8_t len);
+
+// Number of bytes in the queue
+uint8_t FfbReportQueueUsed(void);
+
+// Returns 1 if a report of any size fits in the queue
+uint8_t FfbReportQueueHasRoom(void);
+
+// Handle a limited number of queued reports. Call once per main loop pass.
+void FfbProcessReports(void);
+
+// Returns 1 while the queue holds reports that must take effect before a new
+// effect block is allocated (Block Free, Device Control). Control requests
+// wait in the endpoint meanwhile, see main().
+uint8_t FfbAllocationPending(void);
+
+// Report queue and effect creation statistics
+typedef struct
+	{
+	uint16_t received;	// reports queued
+	uint16_t dropped;	// reports lost because the queue was full or the packet was malformed
+	uint16_t merged;	// reports that replaced an older queued report
+	uint8_t maxUsed;	// highest queue fill level seen, in bytes
+	uint16_t deferredPasses;	// FfbProcessReports() calls that left reports for a later pass
+	uint16_t effectsCreated;	// Create New Effect requests
+	uint16_t createBurst;	// Create New Effect requests in the latest burst
+	uint16_t createBurstTime;	// ms from the first to the last request of the latest burst
+	} TReportQueueStats;
+
+extern TReportQueueStats gReportStats;
+
+// Send the pending effect parameter modifications to the joystick unless
+// there is too much MIDI data waiting already, and download new effects
+// when the MIDI link is idle. Call once per main loop pass.
+void FfbService(void);
+
+// Get the next PID State input report to send, if the device status or the
+// playing state of an effect has changed since the host was last told.
+// Returns 0 when there is nothing to report.
+uint8_t FfbGetPidState(USB_FFBReport_PIDStatus_Input_Data_t *report);
+
 // Handle incoming feature requests
-void FfbOnCreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData, USB_FFBReport_PIDBlockLoad_Feature_Data_t *outData);
+void FfbOnCreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData);
+void FfbOnPIDBlockLoad(USB_FFBReport_PIDBlockLoad_Feature_Data_t *data);	// result of the latest FfbOnCreateNewEffect()
 void FfbOnPIDPool(USB_FFBReport_PIDPool_Feature_Data_t *data);
 
 // Utility to wait any amount of milliseconds.
@@ -222,15 +308,63 @@ void WaitMs(int ms);
 // max delay 2560us.
 void _delay_us10(uint8_t delay);
 
-// Send raw data to the
+// Send raw data to the joystick's MIDI channel.
+// Each call is sent as one unit that is not interleaved with other data.
 void FfbSendData(const uint8_t *data, uint16_t len);
 void FfbSendPackets(const uint8_t *data, uint16_t len);
+
+// Send effect download/modification data about the given effect (low priority)
+void FfbSendEffectData(uint8_t effectId, const uint8_t *data, uint16_t len);
+
+// Send effect operation or device control (high priority). The data goes out
+// before pending low priority data unless there is such data about the same effect.
+// <effectId> 0 for device control, 0x7F for all effects.
+void FfbSendOperation(uint8_t effectId, const uint8_t *data, uint16_t len);
 void FfbPulseX1( void );
 
+// Number of bytes waiting in the MIDI transmit buffer
+uint8_t FfbMidiBufferUsed(void);
+
+// MIDI transmit statistics per message class.
+// Wait times are in transmitted bytes (1 = 320us).
+typedef struct
+	{
+	uint16_t messages;
+	uint16_t waitMax;
+	uint32_t waitTotal;
+	} TMidiQueueStats;
+
+// MIDI transmit statistics
+typedef struct
+	{
+	TMidiQueueStats queue[2];	// 0=bulk, 1=high priority
+	uint16_t overflows;	// times a sender had to wait for room in the transmit buffers
+	uint16_t rejected;	// messages dropped as too long for the transmit buffers
+	uint8_t maxUsed;	// highest transmit buffer fill level seen
+	uint16_t statusElided;	// status bytes left out by using MIDI running status
+	uint16_t modifiesCoalesced;	// parameter modifications merged into a not yet sent one
+	uint16_t modifiesSuppressed;	// parameter modifications not sent since the value did not change
+	uint16_t modifiesSent;	// parameter modifications sent to joystick
+	uint16_t throttledPasses;	// FfbService() calls that held modifications back due to MIDI backlog
+	uint16_t startsResident;	// effect starts that found the effect already in joystick
+	uint16_t startsDownloaded;	// effect starts that had to send the effect first
+	uint16_t redownloads;	// effects sent again to change what cannot be modified
+	} TMidiStats;
+
+extern volatile TMidiStats gMidiStats;
+
+// MIDI running status is used by default to leave out repeated status bytes.
+// Disable it if a joystick does not understand it.
+void FfbEnableRunningStatus(uint8_t inEnable);
+
+// Forget the last sent status byte e.g. when the joystick is (re)initialized
+void FfbMidiResetRunningStatus(void);
+
 // Debugging
 //	<index> should be pointer to an index variable whose value should be set to 0 to start iterating.
 //	Returns 0 when no more effects
 uint8_t FfbDebugListEffects(uint8_t *index);
+void FfbDebugListStats(void);
 
 // Effect manipulations
 
@@ -241,12 +375,14 @@ typedef struct
 	uint8_t constants;
 	uint8_t triangles;
 	uint8_t sines;
-	uint8_t effectId[MAX_EFFECTS];
+	uint8_t effectId[MAX_EFFECTS / 8 + 1];	// bit (n%8) of byte (n/8) for effect block index n, see FfbEffectDisabled()
 	} TDisabledEffectTypes;
 
-extern volatile TDisabledEffectTypes gDisabledEffects;
+extern TDisabledEffectTypes gDisabledEffects;
+
+#define FfbEffectDisabled(id)	(gDisabledEffects.effectId[(id) >> 3] & (1 << ((id) & 7)))
 
-void FfbSendSysEx(const uint8_t* midi_data, uint8_t len);
+void FfbSendSysEx(uint8_t effectId, const uint8_t* midi_data, uint8_t len);
 uint16_t UsbUint16ToMidiUint14_Time(uint16_t inUsbValue);
 uint16_t UsbUint16ToMidiUint14(uint16_t inUsbValue);
 int16_t UsbInt8ToMidiInt14(int8_t inUsbValue);
@@ -263,8 +399,11 @@ void FfbEnableEffectId(uint8_t inId, uint8_t inEnable);
 #define MEffectState_Allocated		0x01
 #define MEffectState_Playing		0x02
 #define MEffectState_SentToJoystick	0x04
+#define MEffectState_Redownload		0x08	// must be sent again, see FfbRequestRedownload()
+#define MEffectState_Timed			0x10	// joystick stops playing the effect by itself at <playEnd>
 
 #define USB_DURATION_INFINITE	0x7FFF
+#define USB_LOOP_COUNT_INFINITE	0xFF
 #define MIDI_DURATION_INFINITE	0
 
 #define USB_EFFECT_CONSTANT		0x01
@@ -282,6 +421,13 @@ void FfbEnableEffectId(uint8_t inId, uint8_t inEnable);
 
 #define MAX_MIDI_MSG_LEN 27 /* enough to hold longest midi message data part, FFP_MIDI_Effect_Basic */
 
+// The MIDI data of the effects is kept in a pool of units. An effect takes one
+// unit or, when the data of its type (see the driver's EffectDataLength) does
+// not fit in one, two adjacent units. So the small and large effects share the
+// whole pool: e.g. 14 basic effects or 28 conditions, or any mix in between.
+#define FFB_DATA_UNIT_SIZE	15	/* FFP_MIDI_Effect_Spring_Inertia_Damper, enough for friction and wheel conditions and constant force too */
+#define FFB_DATA_UNITS		28
+
 /* start of midi data common for both pro and wheel protocols */
 typedef struct {
 	uint8_t command;	// 0x23 for pro, 0x20 for wheel
@@ -296,29 +442,58 @@ typedef struct {
 	// These are used to calculate effects of USB gain to MIDI data
 	uint8_t usb_gain, usb_offset, usb_attackLevel, usb_fadeLevel;
 	uint8_t usb_magnitude;
-	volatile uint8_t	data[MAX_MIDI_MSG_LEN];
+	uint16_t dirty;	// modified parameters not yet sent to joystick, see driver's FlushModify
+	uint8_t length;	// length of <data> in the effect's SysEx, set when first sent to joystick
+	uint16_t playEnd;	// ms time when a finite effect stops playing, see <MEffectState_Timed>
+	uint8_t loopsLeft;	// times to play the effect again after <playEnd>, USB_LOOP_COUNT_INFINITE for ever
+	uint8_t	*data;	// slot from the MIDI data pools while allocated, see FfbEffectDataSize()
+	uint8_t sysexEnd[2];	// checksum of <data> and SysEx end mark, kept up to date when <data> changes
 	} TEffectState;
 
+// Size of the MIDI data slot of the effect, 0 if the effect is free.
+// The data past it belongs to other effects and must not be changed.
+uint8_t FfbEffectDataSize(TEffectState* effect);
+
+// Change the effect data of an effect that may have been sent to joystick.
+// Keeps the checksum of the effect's SysEx up to date.
+void FfbSetEffectByte(TEffectState* effect, uint8_t offset, uint8_t value);
+void FfbSetEffectWord(TEffectState* effect, uint8_t offset, uint16_t value);
+
+// Send all the allocated effects to joystick again e.g. after it has been power cycled
+void FfbDownloadAllEffects(void);
+
+// Have the effect sent again to the joystick, replacing the old one, for a change
+// that the joystick cannot do with a modification. Done by FfbService().
+void FfbRequestRedownload(TEffectState* effect);
+
 typedef struct
 	{
 	void (*EnableInterrupts)(void);
 	const uint8_t* (*GetSysExHeader)(uint8_t* hdr_len);
 	void (*SetAutoCenter)(uint8_t enable);
 	uint8_t (*UsbToMidiEffectType)(uint8_t usb_effect_type);
+	uint8_t (*EffectDataLength)(uint8_t usb_effect_type);	// MIDI data length of the USB effect type (1..12)
 	
 	void (*StartEffect)(uint8_t eid);
 	void (*StopEffect)(uint8_t eid);
 	void (*FreeEffect)(uint8_t eid);
+	void (*StopAllEffects)(void);	// NULL if the effects must be stopped one by one
 	
-	void (*ModifyDuration)(uint8_t effectId, uint16_t duration);
+	void (*ModifyDuration)(uint8_t effectId, TEffectState* effect, uint16_t duration);
+	void (*FlushModify)(uint8_t effectId, TEffectState* effect);
+
+	// Have the next download of the effect go to the given effect block index,
+	// replacing any effect there, or to the joystick's lowest free index (0x7F).
+	// NULL if the joystick cannot be told the index.
+	void (*SetDownloadIndex)(TEffectState* effect, uint8_t index);
 	
-	void (*CreateNewEffect)(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData, volatile TEffectState* effect);
-	void (*SetEnvelope)(USB_FFBReport_SetEnvelope_Output_Data_t* data, volatile TEffectState* effect);
-	void (*SetCondition)(USB_FFBReport_SetCondition_Output_Data_t* data, volatile TEffectState* effect);
-	void (*SetPeriodic)(USB_FFBReport_SetPeriodic_Output_Data_t* data, volatile TEffectState* effect);
-	void (*SetConstantForce)(USB_FFBReport_SetConstantForce_Output_Data_t* data, volatile TEffectState* effect);
-	void (*SetRampForce)(USB_FFBReport_SetRampForce_Output_Data_t* data, volatile TEffectState* effect);
-	int  (*SetEffect)(USB_FFBReport_SetEffect_Output_Data_t* data, volatile TEffectState* effect);
+	void (*CreateNewEffect)(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData, TEffectState* effect);
+	void (*SetEnvelope)(USB_FFBReport_SetEnvelope_Output_Data_t* data, TEffectState* effect);
+	void (*SetCondition)(USB_FFBReport_SetCondition_Output_Data_t* data, TEffectState* effect);
+	void (*SetPeriodic)(USB_FFBReport_SetPeriodic_Output_Data_t* data, TEffectState* effect);
+	void (*SetConstantForce)(USB_FFBReport_SetConstantForce_Output_Data_t* data, TEffectState* effect);
+	void (*SetRampForce)(USB_FFBReport_SetRampForce_Output_Data_t* data, TEffectState* effect);
+	int  (*SetEffect)(USB_FFBReport_SetEffect_Output_Data_t* data, TEffectState* effect);
 	} FFB_Driver;
 
 #endif // _FFB_PRO_
\ No newline at end of file
@@ -40,6 +40,7 @@
 #include "Descriptors.h"
 
 void CDC1_Task(void);
+static bool NewFrame(void);
 
 /** Contains the current baud rate and other settings of the first virtual serial port. While this demo does not use
  *  the physical USART and thus does not use these settings, they must still be retained and returned to the host
@@ -52,6 +53,20 @@ void CDC1_Task(void);
 
 
 
+#ifdef ENABLE_JOYSTICK_SERIAL
+bool gSerialEnabled = true;
+
+// Whether to present the COM serial port. Erased EEPROM (0xFF) enables it.
+static uint8_t EEMEM sSerialSetting = 1;
+
+// Holding these buttons (7 and 8) while the adapter starts toggles the setting above
+#define SERIAL_TOGGLE_BUTTONS	0x00C0
+#define SERIAL_TOGGLE_READS	5	// consecutive valid reads with only the toggle buttons down
+#define SERIAL_TOGGLE_READ_INTERVAL	20	// ms
+#else
+bool gSerialEnabled = false;
+#endif // ENABLE_JOYSTICK_SERIAL
+
 static CDC_LineEncoding_t LineEncoding1 = { .BaudRateBPS = 0,
                                             .CharFormat  = CDC_LINEENCODING_OneStopBit,
                                             .ParityType  = CDC_PARITY_None,
@@ -79,13 +94,26 @@ int main(void)
 			}
 
 		HID_Task();
-		FlushDebugBuffer();
+		FfbProcessReports();
 
-		CDC1_Task();
-		FlushDebugBuffer();
+		// MIDI and the serial port are served once per frame
+		if (NewFrame())
+			{
+			FfbService();
 
-		USB_USBTask();
-		FlushDebugBuffer();
+			if (gSerialEnabled)
+				{
+				FlushDebugBuffer();
+				CDC1_Task();
+				FlushDebugBuffer();
+				}
+			}
+
+		// A Create New Effect must see the Block Free and Device Control
+		// reports sent before it, so it waits in the endpoint until those
+		// have been handled
+		if (!FfbAllocationPending())
+			USB_USBTask();
 		}
 	}
 
@@ -99,15 +127,57 @@ void SetupHardware(void)
 	/* Disable clock division */
 	clock_prescale_set(clock_div_1);
 
+	/* Timer 3 runs freely as the timebase within USB frames, see FrameTime() */
+	TCCR3A = 0;
+	TCCR3B = (1 << CS31) | (1 << CS30);	// F_CPU/64 i.e. 4 us per tick
+
 	/* Hardware Initialization */
 	LEDs_Init();
 
 	// Call the joystick's init and connection methods
 	Joystick_Init();
 
+	SelectSerialConfiguration();
+
 	USB_Init();
 	}
 
+/** Chooses whether the device has the COM serial port in addition to the joystick. The choice is
+ *  kept in EEPROM and toggled by holding SERIAL_TOGGLE_BUTTONS down at startup. Without the port,
+ *  there is no debug output and no CDC work in the main loop.
+ *
+ *  The buttons must read down, with no other buttons, on SERIAL_TOGGLE_READS valid reads in a row.
+ *  A failed read is not trusted: it leaves the report zeroed, and the wheel inverts its button bits.
+ */
+void SelectSerialConfiguration(void)
+	{
+#ifdef ENABLE_JOYSTICK_SERIAL
+	uint8_t setting = eeprom_read_byte(&sSerialSetting);
+
+	uint8_t reads = 0;
+	while (reads < SERIAL_TOGGLE_READS)
+		{
+		USB_JoystickReport_Data_t report;
+		if (!Joystick_CreateInputReport(1, &report) || report.Button != SERIAL_TOGGLE_BUTTONS)
+			break;
+
+		reads++;
+		WaitMs(SERIAL_TOGGLE_READ_INTERVAL);
+		}
+
+	if (reads == SERIAL_TOGGLE_READS)
+		{
+		setting = setting ? 0 : 1;
+		eeprom_update_byte(&sSerialSetting, setting);
+		}
+
+	gSerialEnabled = (setting != 0);
+#endif // ENABLE_JOYSTICK_SERIAL
+
+	if (!gSerialEnabled)
+		gDebugMode = DEBUG_TO_NONE;
+	}
+
 /** Event handler for the USB_Connect event. This indicates that the device is enumerating via the status LEDs and
  *  starts the library USB task to begin the enumeration and USB management process.
  */
@@ -126,6 +196,146 @@ void EVENT_USB_Device_Disconnect(void)
 	LEDs_SetAllLEDs(LEDS_NO_LEDS);
 }
 
+// Input reports waiting for the joystick endpoint interrupt.
+// Joystick and PID State reports share the same endpoint. The joystick report
+// is a mailbox: a new read replaces the report still waiting in it, so the host
+// always gets the latest position. PID State reports each tell of a change and
+// are queued instead.
+#define PID_STATE_QUEUE_SIZE	2
+
+// Latest joystick report, also for answering GetReport requests in the interrupt
+static USB_JoystickReport_Data_t sJoystickReport = { .reportId = 1 };
+static uint16_t sJoystickCreated;	// FrameTime() when the report was made
+static volatile bool sJoystickPending = false;	// not sent yet
+
+typedef struct
+	{
+	uint16_t created;	// FrameTime() when the report was made
+	USB_FFBReport_PIDStatus_Input_Data_t data;
+	} TPidStateReport;
+
+static TPidStateReport sPidStateReports[PID_STATE_QUEUE_SIZE];
+static volatile uint8_t sPidStateHead = 0;	// next report to send
+static volatile uint8_t sPidStateUsed = 0;
+static bool sLastWasPidState = false;	// the endpoint interrupt alternates the two kinds
+
+// Frame timebase.
+//
+// The USB start of frame (SOF) every 1 ms is the master tick of the main
+// loop. Timer 3 runs freely and each SOF stores its time, which gives the
+// phase within the frame at any time. The joystick is read once per frame,
+// timed to be ready just before the host polls the input endpoint. The poll
+// shows up as the input endpoint bank becoming free, which also gives the
+// age of the report that the host got.
+#define FRAME_TICKS	250	// timer 3 ticks (4 us) per frame
+#define FRAME_MARGIN	13	// ticks to spare between the end of the read and the poll
+
+static volatile uint16_t sSofTime = 0;	// FrameTime() at the latest SOF
+static volatile uint8_t sSofCount = 0;	// SOFs so far (wraps)
+static uint8_t sServedFrame = 0;	// sSofCount when NewFrame() last returned true
+
+static uint16_t sNextRead = 0;	// FrameTime() of the next joystick read
+static uint16_t sReadTicks = FRAME_TICKS / 4;	// estimated time to read the joystick
+static volatile uint16_t sPollPhase8 = FRAME_TICKS / 2 * 8;	// 8 times the average poll time after SOF
+
+static volatile bool sInBankFull = false;	// a report is waiting for the poll
+static volatile uint16_t sInBankCreated;	// ...and when it was made
+
+TFrameStats gFrameStats = { .ageMin = 0xFFFF };
+
+// Stack headroom. The RAM between the static data and the top of the stack
+// is painted before main() runs, and the painted bytes that are left show how
+// close the deepest stack so far has come to the static data.
+#define STACK_PAINT	0xC5
+
+extern uint8_t _end;	// end of the static data, from the linker
+extern uint8_t __stack;	// top of the RAM
+
+void PaintStack(void) __attribute__ ((naked, used, section (".init1")));
+void PaintStack(void)
+	{
+	// Runs before the C runtime is set up, so no C code here
+	__asm volatile (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACK_PAINT));
+	}
+
+static uint16_t FrameTime(void)
+	{
+	CRITICAL_VAR();
+	ENTER_CRITICAL();
+	uint16_t now = TCNT3;	// 16-bit timer registers are not to be read by the interrupts meanwhile
+	EXIT_CRITICAL_RET(now);
+	}
+
+void EVENT_USB_Device_StartOfFrame(void)
+	{
+	sSofTime = TCNT3;
+	sSofCount++;
+	}
+
+// Returns true once per frame. Without SOFs, i.e. when not configured, always.
+static bool NewFrame(void)
+	{
+	if (USB_DeviceState != DEVICE_STATE_Configured)
+		return true;
+
+	uint8_t frame = sSofCount;
+	if (frame == sServedFrame)
+		return false;
+
+	sServedFrame = frame;
+	return true;
+	}
+
+// Time the next joystick read to end just before the expected poll
+static void ScheduleNextRead(uint16_t now)
+	{
+	uint16_t lead = sReadTicks + FRAME_MARGIN;
+	if (lead >= FRAME_TICKS)
+		{
+		sNextRead = now;	// the read takes the whole frame, do it as often as possible
+		return;
+		}
+
+	CRITICAL_VAR();
+	ENTER_CRITICAL();
+	uint16_t target = (sPollPhase8 / 8 + FRAME_TICKS - lead) % FRAME_TICKS;
+	uint16_t next = sSofTime + target;
+	EXIT_CRITICAL();
+
+	while ((int16_t) (next - now) <= 0)
+		next += FRAME_TICKS;
+	sNextRead = next;
+	}
+
+// The host has taken the report from the input endpoint, called from the endpoint interrupt
+static void FrameOnPoll(uint16_t now)
+	{
+	uint16_t phase = now - sSofTime;
+	if (phase < FRAME_TICKS)
+		sPollPhase8 += phase - sPollPhase8 / 8;
+
+	uint16_t age = now - sInBankCreated;
+	gFrameStats.reports++;
+	gFrameStats.ageLast = age;
+	if (age < gFrameStats.ageMin)
+		gFrameStats.ageMin = age;
+	if (age > gFrameStats.ageMax)
+		gFrameStats.ageMax = age;
+	if (age > FRAME_TICKS)
+		gFrameStats.late++;	// missed the poll it was made for
+	}
+
 /** Event handler for the USB_ConfigurationChanged event. This is fired when the host set the current configuration
  *  of the USB device after enumeration - the device endpoints are configured and the joystick reporting task started.
  */
@@ -133,20 +343,36 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 	{
 	bool ConfigSuccess = true;
 
-	/* Setup HID Report Endpoint */
+	/* Setup HID Report Endpoints. The input endpoint is single banked: with one report per
+	   frame the second bank would only hold an older report. The output endpoint is double
+	   banked so that the host can fill one bank while the other one is being emptied. */
 	ConfigSuccess &= Endpoint_ConfigureEndpoint(JOYSTICK_EPNUM, EP_TYPE_INTERRUPT, ENDPOINT_DIR_IN,
 	                                            JOYSTICK_EPSIZE, ENDPOINT_BANK_SINGLE);
 
 	ConfigSuccess &= Endpoint_ConfigureEndpoint(FFB_EPNUM, EP_TYPE_INTERRUPT, ENDPOINT_DIR_OUT,
-	                                            FFB_EPSIZE, ENDPOINT_BANK_SINGLE);
+	                                            FFB_EPSIZE, ENDPOINT_BANK_DOUBLE);
+
+	/* The HID endpoints are serviced from the endpoint interrupt, see ISR(USB_COM_vect) */
+	sPidStateHead = 0;
+	sPidStateUsed = 0;
+	sJoystickPending = false;
+	sInBankFull = false;
+	sNextRead = TCNT3;	// an old time could look like one up to 131 ms ahead
+	USB_Device_EnableSOFEvents();
+	Endpoint_SelectEndpoint(FFB_EPNUM);
+	UEIENX |= (1 << RXOUTE);
+
 #ifdef ENABLE_JOYSTICK_SERIAL
-	/* Setup first CDC Interface's Endpoints */
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(CDC1_TX_EPNUM, EP_TYPE_BULK, ENDPOINT_DIR_IN,
-	                                            CDC_TXRX_EPSIZE, ENDPOINT_BANK_SINGLE);
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(CDC1_RX_EPNUM, EP_TYPE_BULK, ENDPOINT_DIR_OUT,
-	                                            CDC_TXRX_EPSIZE, ENDPOINT_BANK_SINGLE);
-	ConfigSuccess &= Endpoint_ConfigureEndpoint(CDC1_NOTIFICATION_EPNUM, EP_TYPE_INTERRUPT, ENDPOINT_DIR_IN,
-	                                            CDC_NOTIFICATION_EPSIZE, ENDPOINT_BANK_SINGLE);
+	if (gSerialEnabled)
+		{
+		/* Setup first CDC Interface's Endpoints */
+		ConfigSuccess &= Endpoint_ConfigureEndpoint(CDC1_TX_EPNUM, EP_TYPE_BULK, ENDPOINT_DIR_IN,
+		                                            CDC_TXRX_EPSIZE, ENDPOINT_BANK_SINGLE);
+		ConfigSuccess &= Endpoint_ConfigureEndpoint(CDC1_RX_EPNUM, EP_TYPE_BULK, ENDPOINT_DIR_OUT,
+		                                            CDC_TXRX_EPSIZE, ENDPOINT_BANK_SINGLE);
+		ConfigSuccess &= Endpoint_ConfigureEndpoint(CDC1_NOTIFICATION_EPNUM, EP_TYPE_INTERRUPT, ENDPOINT_DIR_IN,
+		                                            CDC_NOTIFICATION_EPSIZE, ENDPOINT_BANK_SINGLE);
+		}
 #endif // ENABLE_JOYSTICK_SERIAL
 
 	/* Reset line encoding baud rates so that the host knows to send new values */
@@ -157,9 +383,51 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 	}
 
 
-volatile bool sPIDStatusPending = false;
-volatile USB_FFBReport_PIDStatus_Input_Data_t sPIDStatus;
+/** Reads the data stage of a host to device control request, keeping the first <size> bytes in <data>.
+ *  The bytes that do not fit are discarded, so that the whole data stage is taken before the status stage.
+ *  Returns false if the host gave up on the request or sent no data within USB_STREAM_TIMEOUT_MS.
+ */
+static bool ReadControlData(uint8_t *data, uint8_t size)
+	{
+	uint16_t left = USB_ControlRequest.wLength;
+	uint16_t timeout = USB_STREAM_TIMEOUT_MS;
+	uint16_t prevFrame = USB_Device_GetFrameNumber();
+
+	while (left)
+		{
+		uint8_t state = USB_DeviceState;
+		if (state == DEVICE_STATE_Unattached || state == DEVICE_STATE_Suspended || Endpoint_IsSETUPReceived())
+			return false;	// the host gave up on the request
+
+		if (!Endpoint_IsOUTReceived())
+			{
+			uint16_t frame = USB_Device_GetFrameNumber();
+			if (frame != prevFrame)
+				{
+				prevFrame = frame;
+				if (timeout-- == 0)
+					return false;
+				}
+			continue;
+			}
 
+		while (left && Endpoint_BytesInEndpoint())
+			{
+			uint8_t value = Endpoint_Read_8();
+			if (size)
+				{
+				*data++ = value;
+				size--;
+				}
+			left--;
+			}
+
+		Endpoint_ClearOUT();
+		timeout = USB_STREAM_TIMEOUT_MS;
+		}
+
+	return true;
+	}
 
 /** Event handler for the USB_ControlRequest event. This is used to catch and process control requests sent to
  *  the device from the USB host before passing along unhandled control requests to the library for processing
@@ -198,25 +466,23 @@ void EVENT_USB_Device_ControlRequest(void)
 
 		case HID_REQ_GetReport:
 			if (DoDebug(DEBUG_DETAIL))
-				LogTextLf("GetReport");
+				LogTextLfP(PSTR("GetReport"));
 			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE))
 				{
 				LEDs_SetAllLEDs(LEDS_ALL_LEDS);
 
-				/*if (USB_ControlRequest.wValue == 0x0306)
-					{	// Feature 2: PID Block Load Feature Report
-					LogTextP(PSTR("GetReport PID Block Load Feature"));
-					_delay_us(500);	// Windows needs this delay to register the below feature report correctly
+				if (USB_ControlRequest.wValue == 0x0306)
+					{	// Feature 2: PID Block Load Feature Report, result of the preceding Create New Effect
 					USB_FFBReport_PIDBlockLoad_Feature_Data_t featureData;
 					FfbOnPIDBlockLoad(&featureData);
+
 					Endpoint_ClearSETUP();
 
 					// Write the report data to the control endpoint
 					Endpoint_Write_Control_Stream_LE(&featureData, sizeof(USB_FFBReport_PIDBlockLoad_Feature_Data_t));
 					Endpoint_ClearOUT();
 					}
-				else */
-				if (USB_ControlRequest.wValue == 0x0307)
+				else if (USB_ControlRequest.wValue == 0x0307)
 					{	// Feature 3: PID Pool Feature Report
 					USB_FFBReport_PIDPool_Feature_Data_t featureData;
 					FfbOnPIDPool(&featureData);
@@ -229,10 +495,8 @@ void EVENT_USB_Device_ControlRequest(void)
 					}
 				else
 					{
-					USB_JoystickReport_Data_t JoystickReportData;
-
-					/* Create the next HID report to send to the host */
-					Joystick_CreateInputReport(USB_ControlRequest.wValue & 0xFF, &JoystickReportData);
+					/* Reading the stick takes too long here, so send the latest report made by HID_Task() */
+					USB_JoystickReport_Data_t JoystickReportData = sJoystickReport;
 
 					Endpoint_ClearSETUP();
 
@@ -249,7 +513,7 @@ void EVENT_USB_Device_ControlRequest(void)
 			break;
 		case HID_REQ_SetReport:
 			if (DoDebug(DEBUG_DETAIL))
-				LogTextLf("SetReport");
+				LogTextLfP(PSTR("SetReport"));
 
 			if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE))
 				{
@@ -261,27 +525,27 @@ void EVENT_USB_Device_ControlRequest(void)
 				uint16_t len = 0;	// again, enough for all
 
 				len = USB_ControlRequest.wLength;
+				if (len > sizeof(data))
+					len = sizeof(data);
 				
 				// Read in the report data from host
 
-				// Read the report data from the control endpoint
-				Endpoint_Read_Control_Stream_LE(&data, len);
-				Endpoint_ClearStatusStage();
+				// Read the report data from the control endpoint. A longer report
+				// is cut to the buffer, but all of it must be read before the status stage.
+				if (!ReadControlData(data, len))
+					{
+					LEDs_SetAllLEDs(LEDS_NO_LEDS);
+					break;	// no status stage for a request the host has given up
+					}
 
 				// Process the incoming report
 				if (USB_ControlRequest.wValue == 0x0305)
 					{	// Feature 1
-					_delay_us(500);	// Windows does not like to be answered too quickly
 //					LogData("    => SetReport CreateNewEffect:", USB_ControlRequest.wValue & 0xFF, data, len);
 
-					USB_FFBReport_PIDBlockLoad_Feature_Data_t pidBlockLoadData;
-					FfbOnCreateNewEffect((USB_FFBReport_CreateNewEffect_Feature_Data_t*) data, &pidBlockLoadData);
-
-					Endpoint_ClearSETUP();
-
-					// Write the report data to the control endpoint
-					Endpoint_Write_Control_Stream_LE(&pidBlockLoadData, sizeof(USB_FFBReport_PIDBlockLoad_Feature_Data_t));
-					Endpoint_ClearOUT();
+					// The host asks for the result with the PID Block Load GetReport
+					// that follows, so allocate the effect before completing this request.
+					FfbOnCreateNewEffect((USB_FFBReport_CreateNewEffect_Feature_Data_t*) data);
 					}
 				else if (USB_ControlRequest.wValue == 0x0306)
 					{	// Feature 1
@@ -297,6 +561,8 @@ void EVENT_USB_Device_ControlRequest(void)
 					LogData("    => SetReport data: ", USB_ControlRequest.wValue & 0xFF, data, len);
 */
 
+				Endpoint_ClearStatusStage();
+
 				LEDs_SetAllLEDs(LEDS_NO_LEDS);
 				}
 			break;
@@ -351,82 +617,189 @@ void EVENT_USB_Device_ControlRequest(void)
 
 
 
-/** Function to manage HID report generation and transmission to the host. */
+// Let the endpoint interrupt send the new report as soon as the bank is free.
+// Called with interrupts disabled.
+static void EnableInputInterrupt(void)
+	{
+	uint8_t prevEndpoint = Endpoint_GetCurrentEndpoint();
+	Endpoint_SelectEndpoint(JOYSTICK_EPNUM);
+	UEIENX |= (1 << TXINE);
+	Endpoint_SelectEndpoint(prevEndpoint);
+	}
+
+/** Function to manage HID report generation. The reports are sent to the host and the
+ *  force feedback data received from the host in the endpoint interrupt.
+ */
 void HID_Task(void)
 	{
 	/* Device must be connected and configured for the task to run */
 	if (USB_DeviceState != DEVICE_STATE_Configured)
 	  return;
 
-	/* Select the Joystick Report Endpoint */
-	Endpoint_SelectEndpoint(JOYSTICK_EPNUM);
+	/* Changes in effect and device state are sent as PID State reports */
+	if (sPidStateUsed < PID_STATE_QUEUE_SIZE)
+		{
+		USB_FFBReport_PIDStatus_Input_Data_t PIDStateData;
+		if (FfbGetPidState(&PIDStateData))
+			{
+			uint16_t now = FrameTime();
+
+			CRITICAL_VAR();
+			ENTER_CRITICAL();
+			TPidStateReport *slot = &sPidStateReports[(sPidStateHead + sPidStateUsed) % PID_STATE_QUEUE_SIZE];
+			slot->created = now;
+			slot->data = PIDStateData;
+			sPidStateUsed++;
+			EnableInputInterrupt();
+			EXIT_CRITICAL();
+			}
+		}
 
-	/* Check to see if the host is ready for another packet */
-	if (Endpoint_IsINReady())
+	/* Read the joystick once per frame. A read due more than a couple of frames
+	   ahead can only be a stale time, so it is done at once too. */
+	uint16_t now = FrameTime();
+	if ((int16_t) (now - sNextRead) >= 0 || (uint16_t) (sNextRead - now) > 2 * FRAME_TICKS)
 		{
 		USB_JoystickReport_Data_t JoystickReportData;
+		bool valid = Joystick_CreateInputReport(INPUT_REPORTID_ALL, &JoystickReportData);
 
-		/* Create the next HID report to send to the host */
-		Joystick_CreateInputReport(INPUT_REPORTID_ALL, &JoystickReportData);
+		// Follow longer reads at once, shorter ones slowly
+		uint16_t duration = FrameTime() - now;
+		if (duration > sReadTicks)
+			sReadTicks = duration;
+		else
+			sReadTicks -= (sReadTicks - duration) / 16;
 
-		/* Write Joystick Report Data */
-		Endpoint_Write_Stream_LE(&JoystickReportData, sizeof(USB_JoystickReport_Data_t), NULL);
+		now = FrameTime();
+		ScheduleNextRead(now);
 
-		/* Finalize the stream transfer to send the last packet */
-		Endpoint_ClearIN();
+		if (valid)
+			{
+			CRITICAL_VAR();
+			ENTER_CRITICAL();
+			sJoystickReport = JoystickReportData;
+			sJoystickCreated = now;
+			sJoystickPending = true;
+			EnableInputInterrupt();
+			EXIT_CRITICAL();
+			}
 		}
 
-	// Receive FFB data
-	Endpoint_SelectEndpoint(FFB_EPNUM);
+	/* Accept force feedback data again once the report queue has room for it */
+	if (FfbReportQueueHasRoom())
+		{
+		CRITICAL_VAR();
+		ENTER_CRITICAL();
+		uint8_t prevEndpoint = Endpoint_GetCurrentEndpoint();
+		Endpoint_SelectEndpoint(FFB_EPNUM);
+		UEIENX |= (1 << RXOUTE);
+		Endpoint_SelectEndpoint(prevEndpoint);
+		EXIT_CRITICAL();
+		}
+	}
 
-	if (Endpoint_IsOUTReceived())
+// Send the next queued input report, called from the endpoint interrupt
+static void Joystick_EndpointInterrupt(void)
+	{
+	Endpoint_SelectEndpoint(JOYSTICK_EPNUM);
+
+	if (!Endpoint_IsINReady())
+		return;
+
+	if (sInBankFull)
 		{
-		LEDs_SetAllLEDs(LEDS_ALL_LEDS);
+		sInBankFull = false;
+		FrameOnPoll(TCNT3);
+		}
 
-		uint8_t out_ffbdata[64];	// enough for any single OUT-report
-		uint8_t total_bytes_read = 0;
+	// Joystick reports keep flowing between PID State reports
+	bool isPidState = sPidStateUsed && (!sJoystickPending || !sLastWasPidState);
+	if (isPidState)
+		{
+		TPidStateReport *report = &sPidStateReports[sPidStateHead];
+		Endpoint_Write_Stream_LE(&report->data, sizeof(report->data), NULL);
+		sInBankCreated = report->created;
 
-		while (Endpoint_BytesInEndpoint() && total_bytes_read < 64)
-			{
-			uint16_t out_wait_report_bytes = 0, out_report_data_read = 0;
+		sPidStateHead = (sPidStateHead + 1) % PID_STATE_QUEUE_SIZE;
+		sPidStateUsed--;
+		}
+	else if (sJoystickPending)
+		{
+		Endpoint_Write_Stream_LE(&sJoystickReport, sizeof(sJoystickReport), NULL);
+		sInBankCreated = sJoystickCreated;
+		sJoystickPending = false;
+		}
+	else
+		{
+		// Nothing to send - HID_Task() enables the interrupt again with the next report
+		UEIENX &= ~(1 << TXINE);
+		return;
+		}
 
-			// Read the reportID from the package to determine amount of data to expect next
-			while (Endpoint_Read_Stream_LE(&out_ffbdata, 1, NULL)
-					 == ENDPOINT_RWSTREAM_IncompleteTransfer)
-				{	// busy loop until the first byte is read out
-				}
+	Endpoint_ClearIN();
+	sInBankFull = true;
+	sLastWasPidState = isPidState;
+	}
 
-			total_bytes_read += 1;
+// Queue the reports of a received FFB packet, called from the endpoint interrupt.
+// FfbProcessReports() translates them to MIDI later in the main loop.
+static void Ffb_EndpointInterrupt(void)
+	{
+	Endpoint_SelectEndpoint(FFB_EPNUM);
 
-			out_wait_report_bytes = OutReportSize[out_ffbdata[0]-1] - 1;
-			if (out_wait_report_bytes + total_bytes_read >= 64)
-				{
-				while (1)  {
-				LEDs_SetAllLEDs(LEDS_NO_LEDS);
-				_delay_ms(100);
-				LEDs_SetAllLEDs(LEDS_ALL_LEDS);
-				_delay_ms(100); }
-				}
-//			LogTextP(PSTR("Starting to read new report (reportId, bytesToWait)"));
-//			LogBinary(out_ffbdata, 1);
-//			LogBinary((uint8_t*) &out_wait_report_bytes, 2);
-
-			out_report_data_read = 0;
-			while (Endpoint_Read_Stream_LE(&out_ffbdata[1], out_wait_report_bytes, NULL)
-					== ENDPOINT_RWSTREAM_IncompleteTransfer)
-				{	// busy loop until the rest of the report data is read out
-				}
+	// Not while the queue is full
+	if (!(UEIENX & (1 << RXOUTE)) || !Endpoint_IsOUTReceived())
+		return;
+
+	// The packet may hold several reports, each starting with its reportId.
+	// Take them one at a time while the queue has room for them.
+	while (Endpoint_BytesInEndpoint() > 0)
+		{
+		if (!FfbReportQueueHasRoom())
+			{
+			// Leave the rest of the packet in the endpoint until HID_Task() sees room in the queue
+			UEIENX &= ~(1 << RXOUTE);
+			return;
+			}
+
+		uint8_t report[FFB_REPORT_MAX_SIZE];
+		uint8_t len = Endpoint_BytesInEndpoint();
+		report[0] = Endpoint_Read_8();
 
-//			LogData("Read OUT data:", out_ffbdata[0], &out_ffbdata[1], out_wait_report_bytes);
-			total_bytes_read += out_wait_report_bytes;
+		uint8_t size = 0;
+		if (report[0] >= 1 && report[0] <= FFB_OUTPUT_REPORTS)
+			size = OutReportSize[report[0]-1];
 
-			FfbOnUsbData(out_ffbdata, out_wait_report_bytes + 1);
-			_delay_ms(1);
+		if (size == 0 || size > len || size > sizeof(report))
+			{
+			// Unknown or truncated report - the rest of the packet cannot be parsed
+			gReportStats.dropped++;
+			break;
 			}
 
-		// Clear the endpoint ready for new packet
-		Endpoint_ClearOUT();
+		Endpoint_Read_Stream_LE(&report[1], size - 1, NULL);
+		FfbQueueUsbData(report, size);
 		}
+
+	// Release the bank for the next packet
+	Endpoint_ClearOUT();
+
+	if (!FfbReportQueueHasRoom())
+		UEIENX &= ~(1 << RXOUTE);	// HID_Task() enables it again once there is room
+	}
+
+/** Endpoint interrupt for the HID endpoints. Control requests are handled in the main loop. */
+ISR(USB_COM_vect)
+	{
+	uint8_t prevEndpoint = Endpoint_GetCurrentEndpoint();
+
+	if (UEINT & (1 << JOYSTICK_EPNUM))
+		Joystick_EndpointInterrupt();
+
+	if (UEINT & (1 << FFB_EPNUM))
+		Ffb_EndpointInterrupt();
+
+	Endpoint_SelectEndpoint(prevEndpoint);
 	}
 
 
@@ -451,6 +824,22 @@ void HID_Task(void)
 			List all effect info from the adapter/joystick. Sends info about each
 			effect index in the device (loaded or free).
 			
+		"s"
+			Show statistics of the force feedback data processing, e.g.
+			MIDI transmit buffer usage, and the stack headroom.
+
+		"p"
+			Send all allocated effects to the joystick again, e.g. after the
+			joystick has been power cycled.
+
+		"r"
+			Disable MIDI running status i.e. always send the status byte of each
+			MIDI message to the joystick.
+
+		"R"
+			Enable MIDI running status (default) i.e. leave out status bytes
+			that repeat the status byte of the previous message.
+
 		"d" 01 SETTING
 			Disable the given debug setting. Settings are cumulative:
 				01 = Send debug data to UART
@@ -551,6 +940,7 @@ uint8_t ParseHexNibble(char data)
 
 
 void DoCommandListEffects(void);
+void DoCommandListStats(void);
 void DoCommandSetDebug(char command, char value);
 void DoCommandSetEffectType(char effectType, char value);
 void DoCommandSetEffectAtIndex(uint8_t effectIndex, char value);
@@ -584,6 +974,24 @@ void ProcessDataFromCOMSerial(char data)
 			return;
 			}
 
+		if (data == 's')
+			{
+			DoCommandListStats();
+			return;
+			}
+
+		if (data == 'p')
+			{
+			FfbDownloadAllEffects();
+			return;
+			}
+
+		if (data == 'r' || data == 'R')
+			{
+			FfbEnableRunningStatus(data == 'R');
+			return;
+			}
+
 		// The command has parameter data - need to parse and collect them nibble by nibble
 		gOngoingSerialCommand = data;
 		gOngoingSerialCommandParameterPos = 0;
@@ -710,6 +1118,42 @@ void DoCommandListEffects()
 		LogTextP(PSTR(" Sines disabled\n"));
 	}
 
+// Bytes that the stack has never reached
+static uint16_t StackFreeMin(void)
+	{
+	uint16_t free = 0;
+	for (const uint8_t *p = &_end; p <= &__stack && *p == STACK_PAINT; p++)
+		free++;
+	return free;
+	}
+
+void DoCommandListStats()
+	{
+	FfbDebugListStats();
+
+	// Frame timing, in 4 us ticks
+	uint16_t pollPhase = sPollPhase8 / 8;
+	LogTextP(PSTR("Input reports sent="));
+	LogBinary(&gFrameStats.reports, 2);
+	LogTextP(PSTR("\n  poll after SOF="));
+	LogBinary(&pollPhase, 2);
+	LogTextP(PSTR("\n  joystick read="));
+	LogBinary(&sReadTicks, 2);
+	LogTextP(PSTR("\n  age at poll="));
+	LogBinary(&gFrameStats.ageLast, 2);
+	LogTextP(PSTR("\n  min="));
+	LogBinary(&gFrameStats.ageMin, 2);
+	LogTextP(PSTR("\n  max="));
+	LogBinary(&gFrameStats.ageMax, 2);
+	LogTextP(PSTR("\n  late="));
+	LogBinaryLf(&gFrameStats.late, 2);
+	FlushDebugBuffer();
+
+	uint16_t stackFree = StackFreeMin();
+	LogTextP(PSTR("Stack free min="));
+	LogBinaryLf(&stackFree, 2);
+	}
+
 void DoCommandSetDebug(char command, char value)
 	{
 	if (command == 'd')
@@ -40,6 +40,7 @@
 		#include <avr/wdt.h>
 		#include <avr/power.h>
 		#include <avr/interrupt.h>
+		#include <avr/eeprom.h>
 		#include <string.h>
 
 		#include "Descriptors.h"
@@ -66,8 +67,22 @@
 		 *  This mirrors the layout described to the host in the HID report descriptor, in Descriptors.c.
 		 */
 
+		/** Timing of the input reports relative to the host polls, in 4 us ticks. */
+		typedef struct
+		{
+			uint16_t reports;	// input reports taken by the host
+			uint16_t late;	// reports that missed the poll they were timed for
+			uint16_t ageLast;	// time from making a report to the poll that took it
+			uint16_t ageMin;
+			uint16_t ageMax;
+		} TFrameStats;
+
+	/* External Variables: */
+		extern TFrameStats gFrameStats;
+
 	/* Function Prototypes: */
 		void SetupHardware(void);
+		void SelectSerialConfiguration(void);
 		void HID_Task(void);
 
 		void EVENT_USB_Device_Connect(void);